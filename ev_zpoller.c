@@ -0,0 +1,309 @@
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <io.h>
+#endif
+
+#include <ev.h>
+#include <zmq.h>
+
+#include "ev_zpoller.h"
+
+struct ev_zpoller_item_t
+{
+	ev_io w_io;
+	void *socket;
+	int slot;			// in zp->items
+	ev_zpoller_item_t *next;	// in its bucket
+};
+
+static
+void *s_realloc(void *ptr, size_t size)
+{
+	ptr = realloc(ptr, size);
+	if (!ptr) {
+		// same policy as libev
+		fprintf(stderr, "ev_zpoller: memory allocation failed, aborting\n");
+		abort();
+	}
+	return ptr;
+}
+
+static
+int s_ev_fd(zmq_fd_t fd)
+{
+	#ifdef _WIN32
+	// leaks the C runtime descriptor, as in ev_zsock
+	return _open_osfhandle(fd, 0);
+	#else
+	return fd;
+	#endif
+}
+
+static
+int s_bucket(ev_zpoller_t *zp, void *socket)
+{
+	// fibonacci hashing, pointers have their low bits clear
+	uint64_t hash = (uint64_t)(uintptr_t)socket * 0x9E3779B97F4A7C15ull;
+	return (int)(hash >> 32) & (zp->nbuckets - 1);
+}
+
+static
+void s_link(ev_zpoller_t *zp, ev_zpoller_item_t *item)
+{
+	int bucket = s_bucket(zp, item->socket);
+	item->next = zp->buckets[bucket];
+	zp->buckets[bucket] = item;
+}
+
+static
+void s_grow(ev_zpoller_t *zp)
+{
+	ev_zpoller_item_t **old_buckets = zp->buckets;
+	int old_nbuckets = zp->nbuckets;
+
+	zp->nbuckets = zp->nbuckets ? zp->nbuckets * 2 : 64;
+	zp->buckets = (ev_zpoller_item_t **)s_realloc(NULL,
+			zp->nbuckets * sizeof(*zp->buckets));
+	memset(zp->buckets, 0, zp->nbuckets * sizeof(*zp->buckets));
+
+	int bucket;
+	for (bucket=0; bucket < old_nbuckets; bucket++) {
+		ev_zpoller_item_t *item = old_buckets[bucket];
+		while (item) {
+			ev_zpoller_item_t *next = item->next;
+			s_link(zp, item);
+			item = next;
+		}
+	}
+	free(old_buckets);
+}
+
+static
+ev_zpoller_item_t *s_unlink(ev_zpoller_t *zp, void *socket)
+{
+	if (!zp->nbuckets)
+		return NULL;
+
+	ev_zpoller_item_t **link = &zp->buckets[s_bucket(zp, socket)];
+	while (*link && (*link)->socket != socket)
+		link = &(*link)->next;
+
+	ev_zpoller_item_t *item = *link;
+	if (item)
+		*link = item->next;
+	return item;
+}
+
+// the fds only wake up the loop, the check pass does the rest
+
+static
+void s_io_cb(struct ev_loop *loop, ev_io *w, int revents)
+{
+}
+
+static
+void s_idle_cb(struct ev_loop *loop, ev_idle *w, int revents)
+{
+}
+
+static
+void s_prepare_cb(struct ev_loop *loop, ev_prepare *w, int revents)
+{
+	ev_zpoller_t *zp = (ev_zpoller_t *)
+		(((char *)w) - offsetof(ev_zpoller_t, w_prepare));
+
+	// callbacks that sent or received may have consumed the edge of
+	// ZMQ_FD or of the poller's fd: look once more before blocking.
+	if (zp->delivered)
+		ev_idle_start(loop, &zp->w_idle);
+}
+
+static
+void s_check_cb(struct ev_loop *loop, ev_check *w, int revents)
+{
+	ev_zpoller_t *zp = (ev_zpoller_t *)
+		(((char *)w) - offsetof(ev_zpoller_t, w_check));
+
+	ev_idle_stop(loop, &zp->w_idle);
+
+	int count = zmq_poller_wait_all(zp->poller, zp->events, zp->maxevents, 0);
+	zp->delivered = count > 0;
+	if (count > 0)
+		zp->cb(loop, zp, zp->events, count);
+}
+
+void
+ev_zpoller_init(ev_zpoller_t *zp, ev_zpoller_cbfn cb, int max_events)
+{
+	assert(max_events > 0);
+
+	zp->cb = cb;
+	zp->poller = zmq_poller_new();
+	assert(zp->poller);
+	zp->count = 0;
+
+	zp->loop = NULL;
+	zp->events = (zmq_poller_event_t *)s_realloc(NULL,
+			max_events * sizeof(*zp->events));
+	zp->maxevents = max_events;
+	zp->delivered = 0;
+
+	ev_prepare_init(&zp->w_prepare, s_prepare_cb);
+	ev_check_init(&zp->w_check, s_check_cb);
+	ev_idle_init(&zp->w_idle, s_idle_cb);
+	zp->has_fd = 0;
+
+	zp->items = NULL;
+	zp->nitems = 0;
+	zp->maxitems = 0;
+	zp->buckets = NULL;
+	zp->nbuckets = 0;
+}
+
+void
+ev_zpoller_destroy(ev_zpoller_t *zp)
+{
+	assert(!zp->loop);
+
+	int idx;
+	for (idx=0; idx < zp->nitems; idx++)
+		free(zp->items[idx]);
+	free(zp->items);
+	free(zp->buckets);
+	free(zp->events);
+	zmq_poller_destroy(&zp->poller);
+}
+
+void
+ev_zpoller_start(struct ev_loop *loop, ev_zpoller_t *zp)
+{
+	if (zp->loop)
+		return;
+	zp->loop = loop;
+
+	ev_prepare_start(loop, &zp->w_prepare);
+	ev_check_start(loop, &zp->w_check);
+	if (zp->has_fd)
+		ev_io_start(loop, &zp->w_io);
+
+	int idx;
+	for (idx=0; idx < zp->nitems; idx++)
+		ev_io_start(loop, &zp->items[idx]->w_io);
+
+	// find out about what happened before we were watching
+	zp->delivered = 1;
+}
+
+void
+ev_zpoller_stop(struct ev_loop *loop, ev_zpoller_t *zp)
+{
+	if (!zp->loop)
+		return;
+	zp->loop = NULL;
+
+	ev_prepare_stop(loop, &zp->w_prepare);
+	ev_check_stop(loop, &zp->w_check);
+	ev_idle_stop(loop, &zp->w_idle);
+	if (zp->has_fd)
+		ev_io_stop(loop, &zp->w_io);
+
+	int idx;
+	for (idx=0; idx < zp->nitems; idx++)
+		ev_io_stop(loop, &zp->items[idx]->w_io);
+}
+
+static
+int s_thread_safe(void *socket)
+{
+	int thread_safe = 0;
+	size_t optlen = sizeof(thread_safe);
+	if (zmq_getsockopt(socket, ZMQ_THREAD_SAFE, &thread_safe, &optlen)==-1)
+		return 0;
+	return thread_safe;
+}
+
+int
+ev_zpoller_add(ev_zpoller_t *zp, void *socket, void *user_data, short events)
+{
+	if (zmq_poller_add(zp->poller, socket, user_data, events)==-1)
+		return -1;
+	zp->count++;
+
+	if (s_thread_safe(socket)) {
+		// the poller gets its fd along with the first thread-safe socket
+		zmq_fd_t fd;
+		if (!zp->has_fd && zmq_poller_fd(zp->poller, &fd)==0) {
+			ev_io_init(&zp->w_io, s_io_cb, s_ev_fd(fd), EV_READ);
+			zp->has_fd = 1;
+			if (zp->loop)
+				ev_io_start(zp->loop, &zp->w_io);
+		}
+	} else {
+		zmq_fd_t fd;
+		size_t optlen = sizeof(fd);
+		int rc = zmq_getsockopt(socket, ZMQ_FD, &fd, &optlen);
+		assert(rc==0);
+
+		if (zp->nitems==zp->maxitems) {
+			zp->maxitems = zp->maxitems ? zp->maxitems * 2 : 16;
+			zp->items = (ev_zpoller_item_t **)s_realloc(zp->items,
+					zp->maxitems * sizeof(*zp->items));
+		}
+
+		if (zp->nitems >= zp->nbuckets)
+			s_grow(zp);
+
+		ev_zpoller_item_t *item = (ev_zpoller_item_t *)s_realloc(NULL, sizeof(*item));
+		item->socket = socket;
+		ev_io_init(&item->w_io, s_io_cb, s_ev_fd(fd), EV_READ);
+		item->slot = zp->nitems;
+		zp->items[zp->nitems++] = item;
+		s_link(zp, item);
+		if (zp->loop)
+			ev_io_start(zp->loop, &item->w_io);
+	}
+
+	// the socket may be ready already
+	if (zp->loop)
+		zp->delivered = 1;
+	return 0;
+}
+
+int
+ev_zpoller_modify(ev_zpoller_t *zp, void *socket, short events)
+{
+	if (zmq_poller_modify(zp->poller, socket, events)==-1)
+		return -1;
+
+	if (zp->loop)
+		zp->delivered = 1;
+	return 0;
+}
+
+int
+ev_zpoller_remove(ev_zpoller_t *zp, void *socket)
+{
+	if (zmq_poller_remove(zp->poller, socket)==-1)
+		return -1;
+	zp->count--;
+
+	// the poller's fd stays, it is shared by all the thread-safe sockets
+	ev_zpoller_item_t *item = s_unlink(zp, socket);
+	if (item) {
+		if (zp->loop)
+			ev_io_stop(zp->loop, &item->w_io);
+
+		// move the last item into the vacated slot
+		ev_zpoller_item_t *last = zp->items[--zp->nitems];
+		zp->items[item->slot] = last;
+		last->slot = item->slot;
+		free(item);
+	}
+	return 0;
+}
@@ -0,0 +1,83 @@
+#ifndef EV_ZPOLLER_H_
+#define EV_ZPOLLER_H_
+
+#include <ev.h>
+#include <zmq.h>
+
+// zmq_poller_t is only available in libzmq's draft API: the headers must
+// be included with ZMQ_BUILD_DRAFT_API defined, and libzmq must have been
+// built with it (zmq_has("draft")), or zmq_poller_new() does not link.
+#ifndef ZMQ_BUILD_DRAFT_API
+#error "ev_zpoller needs libzmq's draft API, build with -DZMQ_BUILD_DRAFT_API"
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// a single watcher for many sockets, wrapping a zmq_poller_t.
+// the readiness of all its sockets is fetched with one
+// zmq_poller_wait_all() per loop iteration and handed to cb in a batch.
+//
+// only thread-safe sockets (ZMQ_SERVER, ZMQ_CLIENT, ZMQ_RADIO,
+// ZMQ_DISH...) are aggregated behind one fd: they have no ZMQ_FD and all
+// wake the loop through the poller's fd. libzmq signals that fd for
+// thread-safe sockets only, so each regular socket still gets an ev_io
+// on its own ZMQ_FD, as with ev_zsock. their readiness is still fetched
+// in the same zmq_poller_wait_all() call.
+
+struct ev_zpoller_t;
+typedef struct ev_zpoller_t ev_zpoller_t;
+
+struct ev_zpoller_item_t;
+typedef struct ev_zpoller_item_t ev_zpoller_item_t;
+
+// events[].events is a mask of ZMQ_POLLIN / ZMQ_POLLOUT
+typedef void (*ev_zpoller_cbfn)(struct ev_loop *loop, ev_zpoller_t *zp,
+		zmq_poller_event_t *events, int count);
+
+struct ev_zpoller_t
+{
+	void *data;		// rw
+
+	ev_zpoller_cbfn cb;	// read-only
+	void *poller;		// read-only, the zmq_poller_t
+	int count;		// read-only, sockets added
+
+	// private
+	struct ev_loop *loop;	// while started
+	zmq_poller_event_t *events;
+	int maxevents;
+	int delivered;		// the last check pass had events
+	ev_prepare w_prepare;
+	ev_check w_check;
+	ev_idle w_idle;
+	ev_io w_io;		// the poller's fd, once it has one
+	int has_fd;
+	ev_zpoller_item_t **items;	// regular sockets
+	int nitems;
+	int maxitems;
+	ev_zpoller_item_t **buckets;	// the same, hashed by socket
+	int nbuckets;		// power of 2
+};
+
+// max_events is the size of a batch
+void ev_zpoller_init(ev_zpoller_t *zp, ev_zpoller_cbfn cb, int max_events);
+// the watcher must be stopped
+void ev_zpoller_destroy(ev_zpoller_t *zp);
+
+void ev_zpoller_start(struct ev_loop *loop, ev_zpoller_t *zp);
+void ev_zpoller_stop(struct ev_loop *loop, ev_zpoller_t *zp);
+
+// same as zmq_poller_add() / _modify() / _remove(), events being a mask
+// of ZMQ_POLLIN / ZMQ_POLLOUT. may be called while started.
+int ev_zpoller_add(ev_zpoller_t *zp, void *socket, void *user_data, short events);
+int ev_zpoller_modify(ev_zpoller_t *zp, void *socket, short events);
+int ev_zpoller_remove(ev_zpoller_t *zp, void *socket);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
@@ -1,8 +1,15 @@
 #include <assert.h>
+#include <errno.h>
+#include <limits.h>
 #include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
 
 #ifdef _WIN32
 #include <io.h>
+#include <windows.h>
+#else
+#include <pthread.h>
 #endif
 
 #include <ev.h>
@@ -10,13 +17,104 @@
 
 #include "ev_zsock.h"
 
+struct ev_zsock_registry_t
+{
+	struct ev_loop *loop;
+
+	ev_prepare w_prepare;
+	ev_check w_check;
+	ev_idle w_idle;
+
+	// all started watchers, compact.
+	// the eager ones come first, they get polled by every prepare pass.
+	ev_zsock_t **socks;
+	int nsocks;
+	int neager;
+	int maxsocks;
+
+	// watchers to be examined by the next check pass.
+	// entries of watchers stopped meanwhile are NULL.
+	ev_zsock_t **ready;
+	int nready;
+	int maxready;
+
+	// the list being examined by the running check pass.
+	// a watcher in here has ready_index -2 - (its slot).
+	ev_zsock_t **checking;
+	int maxchecking;
+
+	// watchers in busy poll mode, spun on when nothing is ready
+	ev_zsock_t **busy;
+	int nbusy;
+	int maxbusy;
+
+	// the watcher whose callback is running.
+	// reset if the callback stops it.
+	ev_zsock_t *current;
+
+	// scheduling, see ev_zsock_set_budget()
+	int unit;
+	long budget;
+	int prioritized;	// a watcher ever had a priority set
+	ev_zsock_t **sorted;	// scratch space for sorting checking
+	int maxsorted;
+	long allowance;		// for the watcher being dispatched
+	long charged;		// to the watcher being dispatched
+
+	// scratch space for drain and multipart modes, shared by the
+	// watchers of the loop
+	zmq_msg_t *msgs;
+	ev_zsock_frame_t *frames;
+	int maxmsgs;
+
+	ev_zsock_registry_t *next;
+};
+
+// loops may run on several threads, e.g. in an ev_zsock_pool
+static ev_zsock_registry_t *s_registries = NULL;
+#ifdef _WIN32
+static SRWLOCK s_registries_lock = SRWLOCK_INIT;
+#else
+static pthread_mutex_t s_registries_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
 static
-void s_idle_cb(struct ev_loop *loop, ev_idle *w, int revents)
+void s_registries_acquire(void)
 {
+	#ifdef _WIN32
+	AcquireSRWLockExclusive(&s_registries_lock);
+	#else
+	pthread_mutex_lock(&s_registries_lock);
+	#endif
 }
 
 static
-void s_io_cb(struct ev_loop *loop, ev_io *w, int revents)
+void s_registries_release(void)
+{
+	#ifdef _WIN32
+	ReleaseSRWLockExclusive(&s_registries_lock);
+	#else
+	pthread_mutex_unlock(&s_registries_lock);
+	#endif
+}
+
+static void s_insert(ev_zsock_registry_t *reg, ev_zsock_t *wz);
+static void s_remove(ev_zsock_registry_t *reg, ev_zsock_t *wz);
+
+static
+void *s_realloc(void *ptr, size_t size)
+{
+	ptr = realloc(ptr, size);
+	if (!ptr) {
+		// same policy as libev
+		fprintf(stderr, "ev_zsock: memory allocation failed, aborting\n");
+		abort();
+	}
+	return ptr;
+}
+
+static
+void s_idle_cb(struct ev_loop *loop, ev_idle *w, int revents)
 {
 }
 
@@ -29,10 +127,8 @@ int s_get_revents(void *zsock, int events)
 	size_t optlen = sizeof(zmq_events);
 	int rc = zmq_getsockopt(zsock, ZMQ_EVENTS, &zmq_events, &optlen);
 
-	if (rc==-1) {
-		// on error, make callback get called
-		return events;
-	}
+	if (rc==-1)
+		return EV_ERROR;
 
 	if (zmq_events & ZMQ_POLLOUT)
 		revents |= events & EV_WRITE;
@@ -42,32 +138,579 @@ int s_get_revents(void *zsock, int events)
 	return revents;
 }
 
+// after s_get_revents() returned EV_ERROR: whether retrying is pointless.
+// the context got terminated, or libzmq recognized the socket as closed.
 static
-void s_prepare_cb(struct ev_loop *loop, ev_prepare *w, int revents)
+int s_gone(void)
+{
+	return errno==ETERM || errno==ENOTSOCK;
+}
+
+static
+void s_queue_ready(ev_zsock_registry_t *reg, ev_zsock_t *wz)
+{
+	// already queued, or going to be examined by the running check pass.
+	// parked watchers wait for their retry timer.
+	if (wz->ready_index != -1 || wz->parked)
+		return;
+
+	if (reg->nready==reg->maxready) {
+		reg->maxready = reg->maxready ? reg->maxready * 2 : 16;
+		reg->ready = (ev_zsock_t **)s_realloc(reg->ready,
+				reg->maxready * sizeof(*reg->ready));
+	}
+
+	wz->ready_index = reg->nready;
+	reg->ready[reg->nready++] = wz;
+}
+
+static
+void s_charge(ev_zsock_registry_t *reg, size_t size)
+{
+	reg->charged += reg->unit==EV_ZSOCK_BYTES ? (long)size : 1;
+}
+
+static
+void s_io_cb(struct ev_loop *loop, ev_io *w, int revents)
 {
 	ev_zsock_t *wz = (ev_zsock_t *)
-		(((char *)w) - offsetof(ev_zsock_t, w_prepare));
+		(((char *)w) - offsetof(ev_zsock_t, w_io));
+
+	// ZMQ_FD signalled, state of the socket may have changed
+	s_queue_ready(wz->registry, wz);
+
+	#ifdef ZSOCK_LATENCY_HIST
+	if (!wz->t_signalled)
+		wz->t_signalled = latency_hist_now();
+	#endif
+}
+
+static
+ev_tstamp s_busy_window(ev_zsock_t *wz)
+{
+	if (wz->parked || wz->busy_gap > wz->busy_max)
+		return 0.;
+	if (wz->busy_gap==0. || 2 * wz->busy_gap > wz->busy_max)
+		return wz->busy_max;	// no history yet, or close to the limit
+	return 2 * wz->busy_gap;
+}
+
+// returns non-zero if a busy polled socket became ready
+static
+int s_busy_poll(struct ev_loop *loop, ev_zsock_registry_t *reg)
+{
+	ev_tstamp window = 0.;
+	int idx;
+	for (idx=0; idx < reg->nbusy; idx++) {
+		ev_tstamp w = s_busy_window(reg->busy[idx]);
+		if (w > window)
+			window = w;
+	}
+	if (window==0.)
+		return 0;
 
-	revents = s_get_revents(wz->zsock, wz->events);
-	if (revents) {
+	ev_tstamp deadline = ev_time() + window;
+	do {
+		int ready = 0;
+		for (idx=0; idx < reg->nbusy; idx++) {
+			ev_zsock_t *wz = reg->busy[idx];
+			if (!wz->parked && s_get_revents(wz->zsock, wz->events)) {
+				s_queue_ready(reg, wz);
+				ready = 1;
+			}
+		}
+		if (ready)
+			return 1;
+	} while (ev_time() < deadline);
+
+	return 0;
+}
+
+static
+void s_busy_insert(ev_zsock_registry_t *reg, ev_zsock_t *wz)
+{
+	if (reg->nbusy==reg->maxbusy) {
+		reg->maxbusy = reg->maxbusy ? reg->maxbusy * 2 : 4;
+		reg->busy = (ev_zsock_t **)s_realloc(reg->busy,
+				reg->maxbusy * sizeof(*reg->busy));
+	}
+	wz->busy_index = reg->nbusy;
+	reg->busy[reg->nbusy++] = wz;
+}
+
+static
+void s_busy_remove(ev_zsock_registry_t *reg, ev_zsock_t *wz)
+{
+	ev_zsock_t *last = reg->busy[--reg->nbusy];
+	reg->busy[wz->busy_index] = last;
+	last->busy_index = wz->busy_index;
+	wz->busy_index = -1;
+}
+
+static
+void s_prepare_cb(struct ev_loop *loop, ev_prepare *w, int revents)
+{
+	ev_zsock_registry_t *reg = (ev_zsock_registry_t *)
+		(((char *)w) - offsetof(ev_zsock_registry_t, w_prepare));
+
+	// watchers queued since the last check pass: lazy watchers that were
+	// touched or still ready. drop the ones with nothing to report.
+	int idx;
+	for (idx=0; idx < reg->nready; idx++) {
+		ev_zsock_t *wz = reg->ready[idx];
+		if (wz && !s_get_revents(wz->zsock, wz->events)) {
+			reg->ready[idx] = NULL;
+			wz->ready_index = -1;
+		}
+	}
+
+	// a single pass over the eager sockets. this also catches sockets
+	// whose ZMQ_FD edge got consumed by a zmq_send / zmq_recv done outside
+	// of their callback.
+	for (idx=0; idx < reg->neager; idx++) {
+		ev_zsock_t *wz = reg->socks[idx];
+		if (s_get_revents(wz->zsock, wz->events))
+			s_queue_ready(reg, wz);
+	}
+
+	int ready = 0;
+	for (idx=0; idx < reg->nready && !ready; idx++)
+		ready = reg->ready[idx] != NULL;
+
+	if (!ready && reg->nbusy)
+		ready = s_busy_poll(loop, reg);
+
+	if (ready) {
 		// idle ensures that libev will not block
-		ev_idle_start(loop, &wz->w_idle);
+		ev_idle_start(loop, &reg->w_idle);
 	}
 }
 
 static
-void s_check_cb(struct ev_loop *loop, ev_check *w, int revents)
+void s_park(struct ev_loop *loop, ev_zsock_registry_t *reg, ev_zsock_t *wz)
+{
+	wz->parked = 1;
+	ev_io_stop(loop, &wz->w_io);
+
+	// out of the eager ones, so that prepare skips it
+	s_remove(reg, wz);
+	s_insert(reg, wz);
+
+	wz->backoff = EV_ZSOCK_BACKOFF_MIN;
+	ev_timer_set(&wz->w_retry, wz->backoff, 0.);
+	ev_timer_start(loop, &wz->w_retry);
+}
+
+static
+void s_retry_cb(struct ev_loop *loop, ev_timer *w, int revents)
 {
 	ev_zsock_t *wz = (ev_zsock_t *)
-		(((char *)w) - offsetof(ev_zsock_t, w_check));
+		(((char *)w) - offsetof(ev_zsock_t, w_retry));
+	ev_zsock_registry_t *reg = wz->registry;
+
+	if (s_get_revents(wz->zsock, wz->events) & EV_ERROR) {
+		wz->errors++;
+		if (s_gone()) {
+			// cb already got EV_ERROR when it was parked
+			ev_zsock_stop(loop, wz);
+			return;
+		}
+		wz->backoff *= 2;
+		if (wz->backoff > EV_ZSOCK_BACKOFF_MAX)
+			wz->backoff = EV_ZSOCK_BACKOFF_MAX;
+		ev_timer_set(&wz->w_retry, wz->backoff, 0.);
+		ev_timer_start(loop, &wz->w_retry);
+		return;
+	}
+
+	wz->parked = 0;
+	s_remove(reg, wz);
+	s_insert(reg, wz);
+	ev_io_start(loop, &wz->w_io);
+	s_queue_ready(reg, wz);
+}
+
+// keeps the first nlive messages, which are moved rather than copied
+static
+void s_msgs_grow(ev_zsock_registry_t *reg, int nlive, int maxmsgs)
+{
+	zmq_msg_t *msgs = (zmq_msg_t *)s_realloc(NULL, maxmsgs * sizeof(*msgs));
+	int idx;
+	for (idx=0; idx < nlive; idx++) {
+		zmq_msg_init(&msgs[idx]);
+		zmq_msg_move(&msgs[idx], &reg->msgs[idx]);
+		zmq_msg_close(&reg->msgs[idx]);
+	}
+	free(reg->msgs);
+	reg->msgs = msgs;
+
+	reg->frames = (ev_zsock_frame_t *)s_realloc(reg->frames,
+			maxmsgs * sizeof(*reg->frames));
+	reg->maxmsgs = maxmsgs;
+}
+
+// returns non-zero if the budget ran out before the socket did
+static
+int s_drain(struct ev_loop *loop, ev_zsock_registry_t *reg, ev_zsock_t *wz)
+{
+	if (reg->maxmsgs < wz->drain_max)
+		s_msgs_grow(reg, 0, wz->drain_max);
+
+	ev_tstamp deadline = wz->drain_time > 0 ? ev_time() + wz->drain_time : 0;
+	int exhausted = 1;
+	int count;
+	for (count=0; count < wz->drain_max && reg->charged < reg->allowance; count++) {
+		// checking the clock is cheap but not free
+		if (deadline > 0 && count > 0 && (count & 7)==0
+				&& ev_time() >= deadline)
+			break;
+
+		zmq_msg_t *msg = &reg->msgs[count];
+		zmq_msg_init(msg);
+		if (zmq_msg_recv(msg, wz->zsock, ZMQ_DONTWAIT)==-1) {
+			zmq_msg_close(msg);
+			exhausted = 0;
+			break;
+		}
+		s_charge(reg, zmq_msg_size(msg));
+	}
+
+	wz->drained = count;
+	if (count > 0) {
+		wz->drain_cb(loop, wz, reg->msgs, count);
+
+		int idx;
+		for (idx=0; idx < count; idx++)
+			zmq_msg_close(&reg->msgs[idx]);
+	}
+
+	return exhausted;
+}
 
-	ev_idle_stop(loop, &wz->w_idle);
+// receives a whole message into reg->msgs. libzmq delivers the frames of a
+// message atomically, so only the first one may find nothing pending.
+// returns the number of frames, 0 if none came or the socket failed midway.
+static
+int s_recv_multipart(ev_zsock_registry_t *reg, ev_zsock_t *wz)
+{
+	int nframes = 0;
+	for (;;) {
+		if (nframes==reg->maxmsgs)
+			s_msgs_grow(reg, nframes, nframes ? nframes * 2 : 16);
+
+		zmq_msg_t *msg = &reg->msgs[nframes];
+		zmq_msg_init(msg);
+		if (zmq_msg_recv(msg, wz->zsock, ZMQ_DONTWAIT)==-1) {
+			zmq_msg_close(msg);
+			break;
+		}
+		nframes++;
+		if (!zmq_msg_more(msg))
+			return nframes;
+	}
+
+	while (nframes > 0)
+		zmq_msg_close(&reg->msgs[--nframes]);
+	return 0;
+}
+
+// returns non-zero if the budget ran out before the socket did
+static
+int s_multipart(struct ev_loop *loop, ev_zsock_registry_t *reg, ev_zsock_t *wz)
+{
+	int exhausted = 1;
+	int count;
+	wz->drained = 0;
+	for (count=0; count < wz->multipart_max && reg->charged < reg->allowance; count++) {
+		int nframes = s_recv_multipart(reg, wz);
+		if (nframes==0) {
+			exhausted = 0;
+			break;
+		}
+
+		// only once all are in, reg->msgs may have moved
+		size_t size = 0;
+		int idx;
+		for (idx=0; idx < nframes; idx++) {
+			reg->frames[idx].data = zmq_msg_data(&reg->msgs[idx]);
+			reg->frames[idx].size = zmq_msg_size(&reg->msgs[idx]);
+			size += reg->frames[idx].size;
+		}
+		s_charge(reg, size);
+
+		// the watcher is not to be touched once the callback returns
+		wz->drained = count + 1;
+		wz->multipart_cb(loop, wz, reg->frames, reg->msgs, nframes);
+
+		for (idx=0; idx < nframes; idx++)
+			zmq_msg_close(&reg->msgs[idx]);
+
+		// the callback may have stopped and freed the watcher
+		if (reg->current!=wz) {
+			exhausted = 0;
+			break;
+		}
+	}
+
+	return exhausted;
+}
+
+// stable, higher priorities first. stopped watchers are dropped.
+static
+int s_sort_checking(ev_zsock_registry_t *reg, int nchecking)
+{
+	if (reg->maxsorted < reg->maxchecking) {
+		reg->maxsorted = reg->maxchecking;
+		reg->sorted = (ev_zsock_t **)s_realloc(reg->sorted,
+				reg->maxsorted * sizeof(*reg->sorted));
+	}
 
-	revents = s_get_revents(wz->zsock, wz->events);
-	if (revents)
-	{
-		wz->cb(loop, wz, revents);
+	int nsorted = 0;
+	int priority;
+	for (priority=EV_ZSOCK_MAXPRI; priority >= EV_ZSOCK_MINPRI; priority--) {
+		int idx;
+		for (idx=0; idx < nchecking; idx++) {
+			ev_zsock_t *wz = reg->checking[idx];
+			if (wz && wz->priority==priority)
+				reg->sorted[nsorted++] = wz;
+		}
 	}
+
+	ev_zsock_t **sorted = reg->sorted;
+	int maxsorted = reg->maxsorted;
+	reg->sorted = reg->checking;
+	reg->maxsorted = reg->maxchecking;
+	reg->checking = sorted;
+	reg->maxchecking = maxsorted;
+
+	return nsorted;
+}
+
+static
+void s_check_cb(struct ev_loop *loop, ev_check *w, int revents)
+{
+	ev_zsock_registry_t *reg = (ev_zsock_registry_t *)
+		(((char *)w) - offsetof(ev_zsock_registry_t, w_check));
+
+	ev_idle_stop(loop, &reg->w_idle);
+
+	// only the sockets that were ready in prepare or whose ZMQ_FD fired.
+	// swap the lists, so that watchers queued by the callbacks go to
+	// the next pass.
+	ev_zsock_t **checking = reg->ready;
+	int nchecking = reg->nready;
+	int maxchecking = reg->maxready;
+	reg->ready = reg->checking;
+	reg->maxready = reg->maxchecking;
+	reg->nready = 0;
+	reg->checking = checking;
+	reg->maxchecking = maxchecking;
+
+	if (reg->prioritized) {
+		nchecking = s_sort_checking(reg, nchecking);
+		checking = reg->checking;
+	}
+
+	long budget_left = reg->budget > 0 ? reg->budget : LONG_MAX;
+	int deferred = 0;
+
+	int idx;
+	for (idx=0; idx < nchecking; idx++) {
+		ev_zsock_t *wz = checking[idx];
+		if (wz)
+			wz->ready_index = -2 - idx;
+	}
+
+	// callbacks may stop any watcher, which clears its entry.
+	for (idx=0; idx < nchecking; idx++) {
+		ev_zsock_t *wz = checking[idx];
+		if (!wz)
+			continue;
+
+		checking[idx] = NULL;
+		wz->ready_index = -1;
+
+		long allowance = budget_left;
+		if (allowance > 0 && wz->quantum > 0) {
+			wz->deficit += wz->quantum;
+			if (wz->deficit < allowance)
+				allowance = wz->deficit;
+		}
+		if (allowance <= 0) {
+			// out of budget or overdrawn: wait for the next pass, ahead
+			// of the watchers that get ready meanwhile
+			s_queue_ready(reg, wz);
+			deferred = 1;
+			continue;
+		}
+		reg->allowance = allowance;
+		reg->charged = 0;
+
+		int revents = s_get_revents(wz->zsock, wz->events);
+		wz->events &= ~(revents & wz->oneshot);
+		reg->current = wz;
+
+		int gone = 0;
+		if (revents & EV_ERROR) {
+			gone = s_gone();
+			wz->errors++;
+			s_park(loop, reg, wz);
+		}
+
+		if (revents && wz->lazy) {
+			// nobody else is going to look at it again
+			s_queue_ready(reg, wz);
+		}
+
+		#ifdef ZSOCK_LATENCY_HIST
+		uint64_t t_dispatch = 0;
+		if (revents) {
+			t_dispatch = latency_hist_now();
+			if (wz->t_signalled) {
+				latency_hist_record(&wz->hist_wait, t_dispatch - wz->t_signalled);
+				wz->t_signalled = 0;
+			}
+		}
+		#endif
+
+		if ((revents & EV_READ) && wz->busy_max > 0.) {
+			ev_tstamp now = ev_now(loop);
+			if (wz->busy_last > 0.)
+				wz->busy_gap += (now - wz->busy_last - wz->busy_gap) / 8;
+			wz->busy_last = now;
+		}
+
+		if ((revents & EV_READ) && wz->drain_cb && !wz->parked) {
+			revents &= ~EV_READ;
+			if (s_drain(loop, reg, wz)) {
+				// messages are still pending, don't let libev block
+				ev_idle_start(loop, &reg->w_idle);
+			}
+		}
+
+		if ((revents & EV_READ) && wz->multipart_cb && !wz->parked) {
+			revents &= ~EV_READ;
+			if (s_multipart(loop, reg, wz))
+				ev_idle_start(loop, &reg->w_idle);
+		}
+
+		if (revents && reg->current==wz)
+		{
+			wz->cb(loop, wz, revents);
+		}
+
+		#ifdef ZSOCK_LATENCY_HIST
+		if (t_dispatch && reg->current==wz)
+			latency_hist_record(&wz->hist_cb, latency_hist_now() - t_dispatch);
+		#endif
+
+		// reported, no use retrying
+		if (gone && reg->current==wz)
+			ev_zsock_stop(loop, wz);
+
+		// the callback may have stopped and freed the watcher
+		budget_left -= reg->charged;
+		if (reg->current==wz && wz->quantum > 0) {
+			// an idle flow does not save up
+			if (reg->charged < allowance)
+				wz->deficit = 0;
+			else
+				wz->deficit -= reg->charged;
+		}
+	}
+	reg->current = NULL;
+	reg->allowance = LONG_MAX;
+
+	if (deferred)
+		ev_idle_start(loop, &reg->w_idle);
+}
+
+ev_zsock_registry_t *
+ev_zsock_registry(struct ev_loop *loop)
+{
+	ev_zsock_registry_t *reg;
+	s_registries_acquire();
+	for (reg = s_registries; reg; reg = reg->next) {
+		if (reg->loop==loop)
+			break;
+	}
+	s_registries_release();
+	if (reg)
+		return reg;
+
+	// only the loop's own thread creates its registry
+	reg = (ev_zsock_registry_t *)s_realloc(NULL, sizeof(*reg));
+	reg->loop = loop;
+
+	ev_prepare *pw_prepare = &reg->w_prepare;
+	ev_prepare_init(pw_prepare, s_prepare_cb);
+
+	ev_check *pw_check = &reg->w_check;
+	ev_check_init(pw_check, s_check_cb);
+
+	ev_idle *pw_idle = &reg->w_idle;
+	ev_idle_init(pw_idle, s_idle_cb);
+
+	reg->socks = NULL;
+	reg->nsocks = 0;
+	reg->neager = 0;
+	reg->maxsocks = 0;
+	reg->ready = NULL;
+	reg->nready = 0;
+	reg->maxready = 0;
+	reg->checking = NULL;
+	reg->maxchecking = 0;
+	reg->busy = NULL;
+	reg->nbusy = 0;
+	reg->maxbusy = 0;
+	reg->current = NULL;
+	reg->unit = EV_ZSOCK_MSGS;
+	reg->budget = 0;
+	reg->prioritized = 0;
+	reg->sorted = NULL;
+	reg->maxsorted = 0;
+	reg->allowance = LONG_MAX;
+	reg->charged = 0;
+	reg->msgs = NULL;
+	reg->frames = NULL;
+	reg->maxmsgs = 0;
+
+	s_registries_acquire();
+	reg->next = s_registries;
+	s_registries = reg;
+	s_registries_release();
+
+	return reg;
+}
+
+void
+ev_zsock_registry_destroy(struct ev_loop *loop)
+{
+	ev_zsock_registry_t **preg;
+	s_registries_acquire();
+	for (preg = &s_registries; *preg; preg = &(*preg)->next) {
+		if ((*preg)->loop==loop)
+			break;
+	}
+
+	ev_zsock_registry_t *reg = *preg;
+	if (reg)
+		*preg = reg->next;
+	s_registries_release();
+	if (!reg)
+		return;
+
+	while (reg->nsocks)
+		ev_zsock_stop(loop, reg->socks[reg->nsocks - 1]);
+
+	free(reg->socks);
+	free(reg->ready);
+	free(reg->checking);
+	free(reg->busy);
+	free(reg->sorted);
+	free(reg->msgs);
+	free(reg->frames);
+	free(reg);
 }
 
 void
@@ -76,15 +719,38 @@ ev_zsock_init(ev_zsock_t *wz, ev_zsock_cbfn cb, void *zsock, int events)
 	wz->cb = cb;
 	wz->zsock = zsock;
 	wz->events = events;
+	wz->drained = 0;
 
-	ev_prepare *pw_prepare = &wz->w_prepare;
-	ev_prepare_init(pw_prepare, s_prepare_cb);
+	wz->errors = 0;
 
-	ev_check *pw_check = &wz->w_check;
-	ev_check_init(pw_check, s_check_cb);
+	wz->oneshot = 0;
+	wz->lazy = 0;
+	wz->parked = 0;
+	wz->backoff = 0.;
+	ev_init(&wz->w_retry, s_retry_cb);
+	wz->busy_max = 0.;
+	wz->busy_gap = 0.;
+	wz->busy_last = 0.;
+	wz->busy_index = -1;
+	wz->priority = 0;
+	wz->quantum = 0;
+	wz->deficit = 0;
+	wz->drain_cb = NULL;
+	wz->drain_max = 0;
+	wz->drain_time = 0;
+	wz->multipart_cb = NULL;
+	wz->multipart_max = 0;
+	msgpool_init(&wz->pool, 0);
 
-	ev_idle *pw_idle = &wz->w_idle;
-	ev_idle_init(pw_idle, s_idle_cb);
+	wz->registry = NULL;
+	wz->index = -1;
+	wz->ready_index = -1;
+
+	#ifdef ZSOCK_LATENCY_HIST
+	wz->t_signalled = 0;
+	latency_hist_reset(&wz->hist_wait);
+	latency_hist_reset(&wz->hist_cb);
+	#endif
 
 	zmq_pollitem_t item;
 	size_t optlen = sizeof(item.fd);
@@ -104,18 +770,300 @@ ev_zsock_init(ev_zsock_t *wz, ev_zsock_cbfn cb, void *zsock, int events)
 	ev_io_init(pw_io, s_io_cb, fd, wz->events ? EV_READ : 0);
 }
 
+static
+void s_insert(ev_zsock_registry_t *reg, ev_zsock_t *wz)
+{
+	if (reg->nsocks==reg->maxsocks) {
+		reg->maxsocks = reg->maxsocks ? reg->maxsocks * 2 : 16;
+		reg->socks = (ev_zsock_t **)s_realloc(reg->socks,
+				reg->maxsocks * sizeof(*reg->socks));
+	}
+
+	int idx = reg->nsocks++;
+	if (!wz->lazy && !wz->parked) {
+		// make room at the end of the eager ones
+		if (reg->neager < idx) {
+			reg->socks[idx] = reg->socks[reg->neager];
+			reg->socks[idx]->index = idx;
+		}
+		idx = reg->neager++;
+	}
+
+	reg->socks[idx] = wz;
+	wz->index = idx;
+}
+
+static
+void s_remove(ev_zsock_registry_t *reg, ev_zsock_t *wz)
+{
+	int idx = wz->index;
+	if (idx < reg->neager) {
+		// fill the hole with the last eager one, which moves the hole
+		// to the start of the lazy ones
+		ev_zsock_t *last = reg->socks[--reg->neager];
+		reg->socks[idx] = last;
+		last->index = idx;
+		idx = reg->neager;
+	}
+
+	// move the last watcher into the vacated slot
+	int end = --reg->nsocks;
+	if (idx < end) {
+		ev_zsock_t *last = reg->socks[end];
+		reg->socks[idx] = last;
+		last->index = idx;
+	}
+	wz->index = -1;
+}
+
 void ev_zsock_start(struct ev_loop *loop, ev_zsock_t *wz)
 {
-	ev_prepare_start(loop, &wz->w_prepare);
-	ev_check_start(loop, &wz->w_check);
+	if (wz->index >= 0)
+		return;
+
+	ev_zsock_registry_t *reg = ev_zsock_registry(loop);
+
+	wz->registry = reg;
+	s_insert(reg, wz);
+	if (wz->priority)
+		reg->prioritized = 1;
+
+	if (reg->nsocks==1) {
+		ev_prepare_start(loop, &reg->w_prepare);
+		ev_check_start(loop, &reg->w_check);
+	}
+
 	ev_io_start(loop, &wz->w_io);
+	if (wz->busy_max > 0.)
+		s_busy_insert(reg, wz);
+
+	// find out about messages that arrived before we were watching
+	s_queue_ready(reg, wz);
 }
 
 void ev_zsock_stop(struct ev_loop *loop, ev_zsock_t *wz)
 {
-	ev_prepare_stop(loop, &wz->w_prepare);
-	ev_check_stop(loop, &wz->w_check);
-	ev_idle_stop(loop, &wz->w_idle);
+	ev_zsock_registry_t *reg = wz->registry;
+	if (wz->index < 0)
+		return;
+
 	ev_io_stop(loop, &wz->w_io);
+	ev_timer_stop(loop, &wz->w_retry);
+	wz->parked = 0;
+
+	if (wz->ready_index >= 0)
+		reg->ready[wz->ready_index] = NULL;
+	else if (wz->ready_index < -1)
+		reg->checking[-2 - wz->ready_index] = NULL;
+	wz->ready_index = -1;
+	if (reg->current==wz)
+		reg->current = NULL;
+
+	s_remove(reg, wz);
+	if (wz->busy_index >= 0)
+		s_busy_remove(reg, wz);
+	wz->registry = NULL;
+
+	if (reg->nsocks==0) {
+		ev_prepare_stop(loop, &reg->w_prepare);
+		ev_check_stop(loop, &reg->w_check);
+		ev_idle_stop(loop, &reg->w_idle);
+	}
+}
+
+void
+ev_zsock_set_busy_poll(ev_zsock_t *wz, ev_tstamp max_spin)
+{
+	wz->busy_max = max_spin > 0. ? max_spin : 0.;
+	wz->busy_gap = 0.;
+	wz->busy_last = 0.;
+
+	if (wz->index < 0)
+		return;
+	if (wz->busy_max > 0. && wz->busy_index < 0)
+		s_busy_insert(wz->registry, wz);
+	else if (wz->busy_max==0. && wz->busy_index >= 0)
+		s_busy_remove(wz->registry, wz);
+}
+
+void
+ev_zsock_set_priority(ev_zsock_t *wz, int priority)
+{
+	if (priority < EV_ZSOCK_MINPRI)
+		priority = EV_ZSOCK_MINPRI;
+	if (priority > EV_ZSOCK_MAXPRI)
+		priority = EV_ZSOCK_MAXPRI;
+
+	wz->priority = priority;
+	if (priority && wz->index >= 0)
+		wz->registry->prioritized = 1;
+}
+
+void
+ev_zsock_set_quantum(ev_zsock_t *wz, long quantum)
+{
+	wz->quantum = quantum > 0 ? quantum : 0;
+	wz->deficit = 0;
+}
+
+void
+ev_zsock_set_budget(struct ev_loop *loop, int unit, long budget)
+{
+	ev_zsock_registry_t *reg = ev_zsock_registry(loop);
+	reg->unit = unit;
+	reg->budget = budget > 0 ? budget : 0;
+}
+
+void
+ev_zsock_charge(ev_zsock_t *wz, long units)
+{
+	if (wz->index >= 0 && wz->registry->current==wz)
+		wz->registry->charged += units;
+}
+
+int
+ev_zsock_is_parked(ev_zsock_t *wz)
+{
+	return wz->parked;
+}
+
+void
+ev_zsock_set_oneshot(ev_zsock_t *wz, int events)
+{
+	wz->oneshot = events;
+}
+
+void
+ev_zsock_rearm(ev_zsock_t *wz, int events)
+{
+	wz->events |= events;
+	ev_zsock_touch(wz);
+}
+
+void
+ev_zsock_set_lazy(ev_zsock_t *wz, int lazy)
+{
+	ev_zsock_registry_t *reg = wz->registry;
+	lazy = lazy != 0;
+	if (wz->lazy==lazy)
+		return;
+
+	if (wz->index >= 0) {
+		s_remove(reg, wz);
+		wz->lazy = lazy;
+		s_insert(reg, wz);
+		s_queue_ready(reg, wz);
+	} else {
+		wz->lazy = lazy;
+	}
+}
+
+void
+ev_zsock_touch(ev_zsock_t *wz)
+{
+	if (wz->index >= 0)
+		s_queue_ready(wz->registry, wz);
+}
+
+int
+ev_zsock_send(ev_zsock_t *wz, const void *buf, size_t len, int flags)
+{
+	int rc = zmq_send(wz->zsock, buf, len, flags);
+	ev_zsock_touch(wz);
+	return rc;
+}
+
+int
+ev_zsock_recv(ev_zsock_t *wz, void *buf, size_t len, int flags)
+{
+	int rc = zmq_recv(wz->zsock, buf, len, flags);
+	if (rc >= 0 && wz->index >= 0 && wz->registry->current==wz)
+		s_charge(wz->registry, rc);
+	ev_zsock_touch(wz);
+	return rc;
 }
 
+int
+ev_zsock_msg_send(zmq_msg_t *msg, ev_zsock_t *wz, int flags)
+{
+	int rc = zmq_msg_send(msg, wz->zsock, flags);
+	ev_zsock_touch(wz);
+	return rc;
+}
+
+int
+ev_zsock_msg_recv(zmq_msg_t *msg, ev_zsock_t *wz, int flags)
+{
+	int rc = zmq_msg_recv(msg, wz->zsock, flags);
+	if (rc >= 0 && wz->index >= 0 && wz->registry->current==wz)
+		s_charge(wz->registry, rc);
+	ev_zsock_touch(wz);
+	return rc;
+}
+
+void
+ev_zsock_set_drain(ev_zsock_t *wz, ev_zsock_drain_cbfn drain_cb,
+		int max_msgs, ev_tstamp max_time)
+{
+	assert(!drain_cb || max_msgs > 0);
+
+	wz->drain_cb = drain_cb;
+	wz->drain_max = max_msgs;
+	wz->drain_time = max_time;
+	if (drain_cb)
+		wz->multipart_cb = NULL;
+}
+
+void
+ev_zsock_set_multipart(ev_zsock_t *wz, ev_zsock_multipart_cbfn multipart_cb,
+		int max_msgs)
+{
+	assert(!multipart_cb || max_msgs > 0);
+
+	wz->multipart_cb = multipart_cb;
+	wz->multipart_max = max_msgs;
+	if (multipart_cb)
+		wz->drain_cb = NULL;
+}
+
+zmq_msg_t *
+ev_zsock_msg_keep(ev_zsock_t *wz, zmq_msg_t *msg)
+{
+	zmq_msg_t *kept = msgpool_get(&wz->pool);
+	zmq_msg_move(kept, msg);
+	return kept;
+}
+
+void
+ev_zsock_msg_release(ev_zsock_t *wz, zmq_msg_t *msg)
+{
+	msgpool_put(&wz->pool, msg);
+}
+
+void
+ev_zsock_msg_reserve(ev_zsock_t *wz, int count)
+{
+	msgpool_reserve(&wz->pool, count);
+}
+
+void
+ev_zsock_msg_pool_destroy(ev_zsock_t *wz)
+{
+	msgpool_destroy(&wz->pool);
+}
+
+#ifdef ZSOCK_LATENCY_HIST
+void
+ev_zsock_latency_snapshot(ev_zsock_t *wz, latency_hist_t *wait,
+		latency_hist_t *cb, int reset)
+{
+	if (wait)	*wait = wz->hist_wait;
+	if (cb)	*cb = wz->hist_cb;
+
+	if (reset) {
+		latency_hist_reset(&wz->hist_wait);
+		latency_hist_reset(&wz->hist_cb);
+	}
+}
+#endif
+
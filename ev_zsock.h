@@ -2,6 +2,12 @@
 #define EV_ZSOCK_H_
 
 #include <ev.h>
+#include <zmq.h>
+
+#include "msgpool.h"
+#ifdef ZSOCK_LATENCY_HIST
+#include "latency_hist.h"
+#endif
 
 #ifdef __cplusplus
 extern "C" {
@@ -10,27 +16,174 @@ extern "C" {
 struct ev_zsock_t;
 typedef struct ev_zsock_t ev_zsock_t;
 
+// one per struct ev_loop, shared by all the ev_zsock_t started on that loop
+struct ev_zsock_registry_t;
+typedef struct ev_zsock_registry_t ev_zsock_registry_t;
+
 typedef void (*ev_zsock_cbfn)(struct ev_loop *loop, ev_zsock_t *wz, int revents);
 
+// msgs are closed after the callback returns.
+// use ev_zsock_msg_keep() to keep any of them.
+typedef void (*ev_zsock_drain_cbfn)(struct ev_loop *loop, ev_zsock_t *wz,
+		zmq_msg_t *msgs, int count);
+
+// a frame of a multipart message, pointing into its zmq_msg_t
+typedef struct
+{
+	void *data;
+	size_t size;
+} ev_zsock_frame_t;
+
+// frames[i] describes msgs[i]. msgs are closed after the callback returns;
+// a frame is stale once its message was kept with ev_zsock_msg_keep().
+typedef void (*ev_zsock_multipart_cbfn)(struct ev_loop *loop, ev_zsock_t *wz,
+		const ev_zsock_frame_t *frames, zmq_msg_t *msgs, int count);
+
 struct ev_zsock_t
 {
 	void *data;		// rw
 
 	ev_zsock_cbfn cb;	// read-only
 	void *zsock;		// read-only
-	int events;		// read-only
+	int events;		// read-only, armed events
+	int drained;		// read-only, messages delivered by the last wakeup
+	int errors;		// read-only, failed ZMQ_EVENTS queries
 
 	// private
-	ev_prepare w_prepare;
-	ev_check w_check;
-	ev_idle w_idle;
+	int oneshot;
+	int lazy;
+	int parked;
+	ev_tstamp backoff;
+	ev_timer w_retry;
+	ev_tstamp busy_max;
+	ev_tstamp busy_gap;	// moving average of the time between reads
+	ev_tstamp busy_last;
+	int busy_index;		// slot in registry->busy, -1 when not busy polled
+	int priority;
+	long quantum;
+	long deficit;		// left over from the last turn, may be negative
+	ev_zsock_drain_cbfn drain_cb;
+	int drain_max;
+	ev_tstamp drain_time;
+	ev_zsock_multipart_cbfn multipart_cb;
+	int multipart_max;
+	msgpool_t pool;
 	ev_io w_io;
+	ev_zsock_registry_t *registry;
+	int index;		// slot in registry->socks, -1 when stopped
+	int ready_index;	// slot in registry->ready, -1 when not queued
+
+	#ifdef ZSOCK_LATENCY_HIST
+	uint64_t t_signalled;	// when ZMQ_FD fired, 0 once reported
+	latency_hist_t hist_wait;	// ZMQ_FD fired -> callback invoked
+	latency_hist_t hist_cb;	// callback duration
+	#endif
 };
 
 void ev_zsock_init(ev_zsock_t *wz, ev_zsock_cbfn cb, void *zsock, int events);
 void ev_zsock_start(struct ev_loop *loop, ev_zsock_t *wz);
 void ev_zsock_stop(struct ev_loop *loop, ev_zsock_t *wz);
 
+// when ZMQ_EVENTS cannot be read, cb gets EV_ERROR once and the watcher
+// is parked: it is left out of polling and retried with exponential
+// backoff, then resumes once the socket works. stop the watcher from cb to
+// give up on it. if the context got terminated (ETERM) or libzmq reports
+// ENOTSOCK, the watcher gets stopped after cb instead.
+// a watcher must be stopped before its socket is closed: libzmq cannot be
+// called on a closed socket.
+int ev_zsock_is_parked(ev_zsock_t *wz);
+// retry delays of a parked watcher, in seconds
+#define EV_ZSOCK_BACKOFF_MIN 0.001
+#define EV_ZSOCK_BACKOFF_MAX 1.0
+
+// events in the mask (typically EV_WRITE) get disarmed after being
+// reported once, until they are armed again with ev_zsock_rearm().
+// avoids waking up on every iteration for an always writable socket.
+void ev_zsock_set_oneshot(ev_zsock_t *wz, int events);
+void ev_zsock_rearm(ev_zsock_t *wz, int events);
+
+// a lazy watcher is only polled for ZMQ_EVENTS after its ZMQ_FD fired,
+// while it is ready, or after it was touched. the application must then
+// do all its I/O on the socket through the wrappers below, or call
+// ev_zsock_touch() after calling libzmq directly outside of the callback.
+// quiet lazy sockets cost nothing per loop iteration.
+// watchers are eager by default: every prepare pass reads ZMQ_EVENTS on
+// each of them, since an edge of ZMQ_FD consumed by a libzmq call made
+// elsewhere would otherwise go unnoticed. that is one getsockopt per
+// started eager watcher per iteration. only lazy watchers make the cost of
+// an iteration follow the number of ready sockets rather than started ones.
+void ev_zsock_set_lazy(ev_zsock_t *wz, int lazy);
+void ev_zsock_touch(ev_zsock_t *wz);
+int ev_zsock_send(ev_zsock_t *wz, const void *buf, size_t len, int flags);
+int ev_zsock_recv(ev_zsock_t *wz, void *buf, size_t len, int flags);
+int ev_zsock_msg_send(zmq_msg_t *msg, ev_zsock_t *wz, int flags);
+int ev_zsock_msg_recv(zmq_msg_t *msg, ev_zsock_t *wz, int flags);
+
+// busy poll: when nothing is ready, spin on ZMQ_EVENTS for up to max_spin
+// seconds before letting libev block, trading a core for wakeup latency.
+// the spin is cut down to twice the average time between reads, and
+// skipped while reads are further apart than max_spin. 0 turns it off.
+void ev_zsock_set_busy_poll(ev_zsock_t *wz, ev_tstamp max_spin);
+
+// scheduling of the watchers ready in the same loop iteration.
+// higher priorities are served first, ties in the order they got ready.
+// a watcher with a quantum gets that many units per iteration plus what
+// it did not use of the last one while it stays busy (deficit round
+// robin), and a loop with a budget serves that many units per iteration
+// in total. the rest waits for the next iteration, which does not block.
+// units are messages or bytes, per loop. drain and multipart modes are
+// charged for what they receive, plain callbacks for what they receive
+// with ev_zsock_recv() / ev_zsock_msg_recv() or report with
+// ev_zsock_charge(). a quantum or budget of 0 means no limit (the default).
+#define EV_ZSOCK_MINPRI -2
+#define EV_ZSOCK_MAXPRI 2
+#define EV_ZSOCK_MSGS 0
+#define EV_ZSOCK_BYTES 1
+void ev_zsock_set_priority(ev_zsock_t *wz, int priority);
+void ev_zsock_set_quantum(ev_zsock_t *wz, long quantum);
+void ev_zsock_set_budget(struct ev_loop *loop, int unit, long budget);
+// from the watcher's callback, charges it for work done outside of
+// the wrappers
+void ev_zsock_charge(ev_zsock_t *wz, long units);
+
+// drain mode: instead of reporting EV_READ to cb, receive the messages
+// and hand up to max_msgs of them to drain_cb in a single call per wakeup.
+// receiving also stops once max_time seconds have passed (0 for no limit).
+// if a budget runs out, the loop will not block before the next wakeup.
+// pass a NULL drain_cb to go back to the plain callback.
+void ev_zsock_set_drain(ev_zsock_t *wz, ev_zsock_drain_cbfn drain_cb,
+		int max_msgs, ev_tstamp max_time);
+
+// multipart mode: instead of reporting EV_READ to cb, receive whole
+// messages and hand each of them to multipart_cb as an array of frames,
+// up to max_msgs messages per wakeup. frames are not copied and a partial
+// message is never handed out. replaces drain mode, and vice versa.
+// pass a NULL multipart_cb to go back to the plain callback.
+void ev_zsock_set_multipart(ev_zsock_t *wz, ev_zsock_multipart_cbfn multipart_cb,
+		int max_msgs);
+
+// takes ownership of a message handed to drain_cb or multipart_cb without copying its
+// payload. the returned message comes from the watcher's pool and must be
+// given back with ev_zsock_msg_release(), which also closes it.
+zmq_msg_t *ev_zsock_msg_keep(ev_zsock_t *wz, zmq_msg_t *msg);
+void ev_zsock_msg_release(ev_zsock_t *wz, zmq_msg_t *msg);
+// preallocates the pool so that keeping messages does not allocate
+void ev_zsock_msg_reserve(ev_zsock_t *wz, int count);
+// frees the pool, all kept messages must have been released
+void ev_zsock_msg_pool_destroy(ev_zsock_t *wz);
+
+#ifdef ZSOCK_LATENCY_HIST
+// copies the histograms (either pointer may be NULL), then optionally
+// resets them. a callback that stops its own watcher is not timed.
+void ev_zsock_latency_snapshot(ev_zsock_t *wz, latency_hist_t *wait,
+		latency_hist_t *cb, int reset);
+#endif
+
+// the registry is created on the first ev_zsock_start() on a loop.
+// call ev_zsock_registry_destroy() before ev_loop_destroy() to release it.
+ev_zsock_registry_t *ev_zsock_registry(struct ev_loop *loop);
+void ev_zsock_registry_destroy(struct ev_loop *loop);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,106 @@
+#ifndef EV_ZSOCK_HPP_
+#define EV_ZSOCK_HPP_
+
+// header-only C++17 wrapper of ev_zsock_t.
+//
+// the handler and the interest mask are template parameters, so the only
+// indirect call left is the one ev_zsock makes into a per-type trampoline,
+// which has the handler inlined. with a single event in the mask the
+// handler gets that event as a constant and its own revents tests fold
+// away; only EV_ERROR is still checked at runtime.
+//
+//	struct on_msg {
+//		template <class W> void operator()(W &w, int revents) { ... }
+//	};
+//	evzsock::watcher<EV_READ, on_msg> w(loop, zsock);
+//
+// or with a lambda, see make_watcher(), or with a member function
+// void session::on_read(int revents):
+//	evzsock::watcher<EV_READ, evzsock::member<&session::on_read>> w(loop, zsock, {this});
+//
+// the watcher is started by the constructor and stopped by the destructor.
+
+#include <utility>
+
+#include "ev_zsock.h"
+
+namespace evzsock {
+
+template <int Events, typename Handler>
+class watcher : private ev_zsock_t
+{
+	static_assert(Events && !(Events & ~(EV_READ | EV_WRITE)),
+			"Events must be EV_READ, EV_WRITE or both");
+
+public:
+	watcher(struct ev_loop *loop, void *zsock, Handler handler = Handler())
+		: handler_(std::move(handler)), loop_(loop)
+	{
+		ev_zsock_init(this, s_trampoline, zsock, Events);
+		ev_zsock_start(loop_, this);
+	}
+
+	~watcher()
+	{
+		ev_zsock_stop(loop_, this);
+		ev_zsock_msg_pool_destroy(this);
+	}
+
+	watcher(const watcher &) = delete;
+	watcher &operator=(const watcher &) = delete;
+
+	void start() { ev_zsock_start(loop_, this); }
+	void stop() { ev_zsock_stop(loop_, this); }
+	bool active() const { return ev_zsock_t::index >= 0; }
+
+	struct ev_loop *loop() const { return loop_; }
+	void *socket() const { return ev_zsock_t::zsock; }
+	Handler &handler() { return handler_; }
+
+	// for the rest of the C API: ev_zsock_set_lazy(w.raw(), 1)...
+	ev_zsock_t *raw() { return this; }
+
+private:
+	static void s_trampoline(struct ev_loop *, ev_zsock_t *wz, int revents)
+	{
+		watcher &self = *static_cast<watcher *>(wz);
+
+		if constexpr (Events==EV_READ || Events==EV_WRITE) {
+			if (revents & EV_ERROR)
+				self.handler_(self, EV_ERROR);
+			else
+				self.handler_(self, Events);
+		} else {
+			self.handler_(self, revents);
+		}
+	}
+
+	Handler handler_;
+	struct ev_loop *loop_;
+};
+
+// deduces the handler type, e.g. for a lambda:
+//	auto w = evzsock::make_watcher<EV_READ>(loop, zsock, [](auto &w, int revents) { ... });
+template <int Events, typename Handler>
+watcher<Events, Handler>
+make_watcher(struct ev_loop *loop, void *zsock, Handler handler)
+{
+	return watcher<Events, Handler>(loop, zsock, std::move(handler));
+}
+
+template <auto Method>
+struct member;
+
+// binds void T::method(int revents) to an object at compile time
+template <typename T, void (T::*Method)(int)>
+struct member<Method>
+{
+	T *object;
+
+	template <typename W>
+	void operator()(W &, int revents) const { (object->*Method)(revents); }
+};
+
+}
+
+#endif
@@ -0,0 +1,450 @@
+#ifndef EV_ZSOCK_CO_HPP_
+#define EV_ZSOCK_CO_HPP_
+
+// C++20 coroutines over ev_zsock_t.
+//
+//	evzsock::task
+//	serve(evzsock::co_loop &loop, void *zsock)
+//	{
+//		evzsock::co_socket sock(loop, zsock);
+//		for (;;) {
+//			evzsock::message msg = co_await sock.recv();
+//			if (msg.error())
+//				break;
+//			co_await sock.send(msg);
+//		}
+//	}
+//
+//	evzsock::co_loop loop(ev_loop);
+//	serve(loop, zsock);	// runs until its first co_await that blocks
+//	ev_run(ev_loop, 0);
+//
+// a send or recv that would block suspends the coroutine, which gets
+// resumed straight from the registry's check pass once the socket is
+// ready. frames of coroutines taking a co_loop & as first parameter come
+// from the loop's frame_arena: no malloc per conversation once warm.
+// everything runs on the loop's thread.
+//
+// coroutines still suspended when their co_loop is destroyed get destroyed
+// with it, which stops their sockets: destroy the co_loop before calling
+// ev_zsock_registry_destroy() on its loop.
+
+#include <coroutine>
+#include <cstddef>
+#include <cstdlib>
+#include <cerrno>
+#include <exception>
+#include <new>
+#include <utility>
+#include <vector>
+
+#include "ev_zsock.h"
+
+namespace evzsock {
+
+// size-classed free lists carved out of chunks that are kept until the
+// arena is destroyed. not thread-safe.
+class frame_arena
+{
+public:
+	frame_arena() : bump_(nullptr), bump_end_(nullptr)
+	{
+		for (auto &head : free_)
+			head = nullptr;
+	}
+
+	~frame_arena()
+	{
+		for (void *chunk : chunks_)
+			::operator delete(chunk);
+	}
+
+	frame_arena(const frame_arena &) = delete;
+	frame_arena &operator=(const frame_arena &) = delete;
+
+	void *allocate(std::size_t size)
+	{
+		std::size_t cls = (size + GRAIN - 1) / GRAIN;
+		if (cls >= CLASSES)
+			return ::operator new(size);
+
+		if (block *head = free_[cls]) {
+			free_[cls] = head->next;
+			return head;
+		}
+
+		std::size_t bytes = cls * GRAIN;
+		if (bump_ + bytes > bump_end_) {
+			// the tail of the previous chunk is given up
+			bump_ = static_cast<char *>(::operator new(CHUNK));
+			bump_end_ = bump_ + CHUNK;
+			chunks_.push_back(bump_);
+		}
+		void *ptr = bump_;
+		bump_ += bytes;
+		return ptr;
+	}
+
+	void deallocate(void *ptr, std::size_t size)
+	{
+		std::size_t cls = (size + GRAIN - 1) / GRAIN;
+		if (cls >= CLASSES) {
+			::operator delete(ptr);
+			return;
+		}
+
+		block *head = static_cast<block *>(ptr);
+		head->next = free_[cls];
+		free_[cls] = head;
+	}
+
+private:
+	struct block { block *next; };
+
+	static constexpr std::size_t GRAIN = 64;
+	static constexpr std::size_t CLASSES = 64;	// frames up to 4 KiB
+	static constexpr std::size_t CHUNK = 64 * 1024;
+
+	block *free_[CLASSES];
+	char *bump_;
+	char *bump_end_;
+	std::vector<void *> chunks_;
+};
+
+class co_loop;
+
+// links the coroutines started on a co_loop
+struct frame_link
+{
+	frame_link *prev;
+	frame_link *next;
+	std::coroutine_handle<> handle;
+};
+
+// a libev loop as seen by coroutines
+class co_loop
+{
+public:
+	explicit co_loop(struct ev_loop *loop) : loop_(loop), frames_(nullptr) {}
+
+	// destroys the coroutines still suspended, before their arena goes
+	~co_loop()
+	{
+		while (frames_)
+			frames_->handle.destroy();
+	}
+
+	co_loop(const co_loop &) = delete;
+	co_loop &operator=(const co_loop &) = delete;
+
+	struct ev_loop *get() const { return loop_; }
+	frame_arena &arena() { return arena_; }
+
+private:
+	friend class task;
+
+	void link(frame_link *frame)
+	{
+		frame->prev = nullptr;
+		frame->next = frames_;
+		if (frames_)
+			frames_->prev = frame;
+		frames_ = frame;
+	}
+
+	void unlink(frame_link *frame)
+	{
+		if (frame->prev)
+			frame->prev->next = frame->next;
+		else
+			frames_ = frame->next;
+		if (frame->next)
+			frame->next->prev = frame->prev;
+	}
+
+	struct ev_loop *loop_;
+	frame_arena arena_;	// destroyed after the frames
+	frame_link *frames_;
+};
+
+// fire and forget: starts right away, frees its frame when it returns.
+// if it takes a co_loop & first, its frame comes from the loop's arena
+// and it is destroyed along with the loop if still suspended.
+class task
+{
+public:
+	struct promise_type : frame_link
+	{
+		template <typename... Args>
+		promise_type(co_loop &loop, Args &&...) : loop_(&loop)
+		{
+			loop.link(this);
+		}
+
+		promise_type() : loop_(nullptr) {}
+
+		~promise_type()
+		{
+			if (loop_)
+				loop_->unlink(this);
+		}
+
+		task get_return_object()
+		{
+			handle = std::coroutine_handle<promise_type>::from_promise(*this);
+			return task();
+		}
+
+		std::suspend_never initial_suspend() noexcept { return {}; }
+		std::suspend_never final_suspend() noexcept { return {}; }
+		void return_void() {}
+		// nobody to rethrow to
+		void unhandled_exception() { std::terminate(); }
+
+		// the arena goes in front of the frame, for operator delete
+		struct alignas(std::max_align_t) header { frame_arena *arena; };
+
+		// the rest of the coroutine's arguments are not looked at.
+		// inlined, or g++ -O0 pairs the template's mangled name with
+		// operator delete's and warns -Wmismatched-new-delete.
+		template <typename... Args>
+		[[gnu::always_inline]]
+		static void *operator new(std::size_t size, co_loop &loop, Args &...)
+		{
+			return s_allocate(size, &loop.arena());
+		}
+
+		static void *operator new(std::size_t size)
+		{
+			return s_allocate(size, nullptr);
+		}
+
+		static void operator delete(void *ptr, std::size_t size)
+		{
+			s_deallocate(ptr, size);
+		}
+
+	private:
+		co_loop *loop_;
+
+		static void s_deallocate(void *ptr, std::size_t size)
+		{
+			header *hdr = static_cast<header *>(ptr) - 1;
+			if (hdr->arena)
+				hdr->arena->deallocate(hdr, size + sizeof(header));
+			else
+				::operator delete(hdr);
+		}
+
+		static void *s_allocate(std::size_t size, frame_arena *arena)
+		{
+			std::size_t total = size + sizeof(header);
+			void *ptr = arena ? arena->allocate(total) : ::operator new(total);
+			header *hdr = static_cast<header *>(ptr);
+			hdr->arena = arena;
+			return hdr + 1;
+		}
+	};
+};
+
+// owns a zmq_msg_t. error() is the errno of a failed recv, 0 otherwise.
+class message
+{
+public:
+	message() : error_(0) { zmq_msg_init(&msg_); }
+	explicit message(std::size_t size) : error_(0) { zmq_msg_init_size(&msg_, size); }
+	~message() { zmq_msg_close(&msg_); }
+
+	message(message &&other) noexcept : error_(other.error_)
+	{
+		zmq_msg_init(&msg_);
+		zmq_msg_move(&msg_, &other.msg_);
+	}
+
+	message &operator=(message &&other) noexcept
+	{
+		zmq_msg_move(&msg_, &other.msg_);
+		error_ = other.error_;
+		return *this;
+	}
+
+	void *data() { return zmq_msg_data(&msg_); }
+	std::size_t size() const { return zmq_msg_size(&msg_); }
+	bool more() const { return zmq_msg_more(&msg_); }
+	int error() const { return error_; }
+	zmq_msg_t *get() { return &msg_; }
+
+private:
+	friend class co_socket;
+
+	zmq_msg_t msg_;
+	int error_;
+};
+
+// one socket, awaited by at most one receiving and one sending coroutine
+class co_socket : private ev_zsock_t
+{
+public:
+	co_socket(co_loop &loop, void *zsock)
+		: loop_(loop.get()), reader_(nullptr), writer_(nullptr), alive_(nullptr)
+	{
+		ev_zsock_init(this, s_trampoline, zsock, EV_READ | EV_WRITE);
+		// armed only while a coroutine waits
+		ev_zsock_set_oneshot(this, EV_READ | EV_WRITE);
+		ev_zsock_start(loop_, this);
+	}
+
+	~co_socket()
+	{
+		if (alive_)
+			*alive_ = false;
+		ev_zsock_stop(loop_, this);
+		ev_zsock_msg_pool_destroy(this);
+	}
+
+	co_socket(const co_socket &) = delete;
+	co_socket &operator=(const co_socket &) = delete;
+
+	void *socket() const { return ev_zsock_t::zsock; }
+	ev_zsock_t *raw() { return this; }
+
+	class recv_awaiter
+	{
+	public:
+		bool await_ready() { return sock_.try_recv(msg_, flags_); }
+
+		void await_suspend(std::coroutine_handle<> handle)
+		{
+			sock_.reader_ = this;
+			handle_ = handle;
+			ev_zsock_rearm(&sock_, EV_READ);
+		}
+
+		message await_resume() { return std::move(msg_); }
+
+	private:
+		friend class co_socket;
+		recv_awaiter(co_socket &sock, int flags) : sock_(sock), flags_(flags) {}
+
+		co_socket &sock_;
+		int flags_;
+		message msg_;
+		std::coroutine_handle<> handle_;
+	};
+
+	class send_awaiter
+	{
+	public:
+		bool await_ready() { return sock_.try_send(*this); }
+
+		void await_suspend(std::coroutine_handle<> handle)
+		{
+			sock_.writer_ = this;
+			handle_ = handle;
+			ev_zsock_rearm(&sock_, EV_WRITE);
+		}
+
+		// like zmq_msg_send(): the size sent, or -1 with errno
+		int await_resume() { errno = error_; return rc_; }
+
+	private:
+		friend class co_socket;
+		send_awaiter(co_socket &sock, message &msg, int flags)
+			: sock_(sock), msg_(msg), flags_(flags), rc_(-1), error_(0) {}
+
+		co_socket &sock_;
+		message &msg_;
+		int flags_;
+		int rc_;
+		int error_;
+		std::coroutine_handle<> handle_;
+	};
+
+	recv_awaiter recv(int flags = 0) { return recv_awaiter(*this, flags); }
+	// msg is emptied once sent
+	send_awaiter send(message &msg, int flags = 0) { return send_awaiter(*this, msg, flags); }
+
+private:
+	// these return true unless the socket would block
+
+	bool try_recv(message &msg, int flags)
+	{
+		if (ev_zsock_msg_recv(&msg.msg_, this, flags | ZMQ_DONTWAIT)==-1) {
+			if (errno==EAGAIN)
+				return false;
+			msg.error_ = errno;
+		} else {
+			msg.error_ = 0;
+		}
+		return true;
+	}
+
+	bool try_send(send_awaiter &aw)
+	{
+		aw.rc_ = ev_zsock_msg_send(&aw.msg_.msg_, this, aw.flags_ | ZMQ_DONTWAIT);
+		if (aw.rc_==-1) {
+			if (errno==EAGAIN)
+				return false;
+			aw.error_ = errno;
+		}
+		return true;
+	}
+
+	// called from the registry's check pass
+	static void s_trampoline(struct ev_loop *, ev_zsock_t *wz, int revents)
+	{
+		co_socket &self = *static_cast<co_socket *>(wz);
+
+		// a resumed coroutine may destroy the socket
+		bool alive = true;
+		self.alive_ = &alive;
+
+		// on EV_ERROR the operation itself reports the error. a parked
+		// socket must not leave the coroutine waiting forever though.
+
+		if ((revents & (EV_WRITE | EV_ERROR)) && self.writer_) {
+			send_awaiter *aw = self.writer_;
+			bool done = self.try_send(*aw);
+			if (!done && (revents & EV_ERROR)) {
+				aw->error_ = EAGAIN;
+				done = true;
+			}
+			if (done) {
+				self.writer_ = nullptr;
+				aw->handle_.resume();
+				if (!alive)
+					return;
+			} else {
+				ev_zsock_rearm(&self, EV_WRITE);
+			}
+		}
+
+		if ((revents & (EV_READ | EV_ERROR)) && self.reader_) {
+			recv_awaiter *aw = self.reader_;
+			bool done = self.try_recv(aw->msg_, aw->flags_);
+			if (!done && (revents & EV_ERROR)) {
+				aw->msg_.error_ = EAGAIN;
+				done = true;
+			}
+			if (done) {
+				self.reader_ = nullptr;
+				aw->handle_.resume();
+				if (!alive)
+					return;
+			} else {
+				ev_zsock_rearm(&self, EV_READ);
+			}
+		}
+
+		self.alive_ = nullptr;
+	}
+
+	struct ev_loop *loop_;
+	recv_awaiter *reader_;
+	send_awaiter *writer_;
+	bool *alive_;		// set while s_trampoline runs
+};
+
+}
+
+#endif
@@ -0,0 +1,372 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <assert.h>
+#include <errno.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include <ev.h>
+#include <zmq.h>
+
+#include "ev_zsock_pool.h"
+
+typedef struct s_job_t s_job_t;
+
+struct s_job_t
+{
+	ev_zsock_pool_fn fn;
+	void *arg;
+	ev_zsock_pool_fn done;
+	s_job_t *next;
+};
+
+typedef struct
+{
+	ev_zsock_pool_t *pool;
+	int index;
+	struct ev_loop *loop;
+	pthread_t thread;
+	int cpu;		// -1 when not pinned, written by the loop thread
+
+	// jobs posted from other threads
+	ev_async w_jobs;
+	pthread_mutex_t mutex;
+	s_job_t *jobs_head;
+	s_job_t *jobs_tail;
+
+	// counters, written by the loop thread only
+	int assigned;
+	uint64_t wakeups;
+	uint64_t idle_ns;
+	ev_tstamp t_started;
+	ev_tstamp t_blocked;
+} s_pool_loop_t;
+
+struct ev_zsock_pool_t
+{
+	int nloops;
+	s_pool_loop_t *loops;
+};
+
+static
+void *s_malloc(size_t size)
+{
+	void *ptr = malloc(size);
+	if (!ptr) {
+		// same policy as libev
+		fprintf(stderr, "ev_zsock_pool: memory allocation failed, aborting\n");
+		abort();
+	}
+	return ptr;
+}
+
+static
+s_pool_loop_t *s_pool_loop(struct ev_loop *loop)
+{
+	return (s_pool_loop_t *)ev_userdata(loop);
+}
+
+// the loop's blocking time, measured around the backend poll
+
+static
+void s_release_cb(struct ev_loop *loop)
+{
+	s_pool_loop_t *pl = s_pool_loop(loop);
+	pl->t_blocked = ev_time();
+}
+
+static
+void s_acquire_cb(struct ev_loop *loop)
+{
+	s_pool_loop_t *pl = s_pool_loop(loop);
+	uint64_t idle_ns = (uint64_t)((ev_time() - pl->t_blocked) * 1e9);
+	__atomic_store_n(&pl->idle_ns, pl->idle_ns + idle_ns, __ATOMIC_RELAXED);
+	__atomic_store_n(&pl->wakeups, pl->wakeups + 1, __ATOMIC_RELAXED);
+}
+
+// returns the number of jobs run
+static
+int s_run_jobs(s_pool_loop_t *pl)
+{
+	pthread_mutex_lock(&pl->mutex);
+	s_job_t *job = pl->jobs_head;
+	pl->jobs_head = NULL;
+	pl->jobs_tail = NULL;
+	pthread_mutex_unlock(&pl->mutex);
+
+	int count = 0;
+	while (job) {
+		s_job_t *next = job->next;
+		job->fn(pl->loop, job->arg);
+		if (job->done)
+			job->done(pl->loop, job->arg);
+		free(job);
+		job = next;
+		count++;
+	}
+	return count;
+}
+
+static
+void s_jobs_cb(struct ev_loop *loop, ev_async *w, int revents)
+{
+	s_pool_loop_t *pl = (s_pool_loop_t *)
+		(((char *)w) - offsetof(s_pool_loop_t, w_jobs));
+
+	s_run_jobs(pl);
+}
+
+static
+void *s_thread_main(void *arg)
+{
+	s_pool_loop_t *pl = (s_pool_loop_t *)arg;
+
+	#ifdef __linux__
+	if (pl->cpu >= 0) {
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		CPU_SET(pl->cpu, &cpus);
+		int rc = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+		if (rc != 0) {
+			fprintf(stderr, "ev_zsock_pool: cannot pin loop %d to cpu %d: %s\n",
+					pl->index, pl->cpu, strerror(rc));
+			__atomic_store_n(&pl->cpu, -1, __ATOMIC_RELAXED);
+		}
+	}
+	#endif
+
+	ev_now_update(pl->loop);
+	ev_tstamp t_started = ev_now(pl->loop);
+	__atomic_store(&pl->t_started, &t_started, __ATOMIC_RELAXED);
+	ev_run(pl->loop, 0);
+	return NULL;
+}
+
+static
+void s_break_fn(struct ev_loop *loop, void *arg)
+{
+	ev_break(loop, EVBREAK_ALL);
+}
+
+static
+void s_post(s_pool_loop_t *pl, ev_zsock_pool_fn fn, void *arg,
+		ev_zsock_pool_fn done)
+{
+	if (pthread_equal(pthread_self(), pl->thread)) {
+		fn(pl->loop, arg);
+		if (done)
+			done(pl->loop, arg);
+		return;
+	}
+
+	s_job_t *job = (s_job_t *)s_malloc(sizeof(*job));
+	job->fn = fn;
+	job->arg = arg;
+	job->done = done;
+	job->next = NULL;
+
+	// the mutex also publishes whatever the caller did to the socket
+	pthread_mutex_lock(&pl->mutex);
+	if (pl->jobs_tail)
+		pl->jobs_tail->next = job;
+	else
+		pl->jobs_head = job;
+	pl->jobs_tail = job;
+	pthread_mutex_unlock(&pl->mutex);
+
+	ev_async_send(pl->loop, &pl->w_jobs);
+}
+
+ev_zsock_pool_t *
+ev_zsock_pool_new(int nloops, int pin)
+{
+	int ncpus = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	if (ncpus < 1)
+		ncpus = 1;
+
+	// the cpus we may run on, which need not be the first ncpus ones
+	int *cpus = NULL;
+	int nallowed = 0;
+	#ifdef __linux__
+	cpu_set_t allowed;
+	if (sched_getaffinity(0, sizeof(allowed), &allowed)==0) {
+		ncpus = CPU_COUNT(&allowed);
+		cpus = (int *)s_malloc(ncpus * sizeof(*cpus));
+		int cpu;
+		for (cpu=0; cpu < CPU_SETSIZE && nallowed < ncpus; cpu++) {
+			if (CPU_ISSET(cpu, &allowed))
+				cpus[nallowed++] = cpu;
+		}
+	} else if (pin) {
+		fprintf(stderr, "ev_zsock_pool: cannot get the cpu affinity, not pinning: %s\n",
+				strerror(errno));
+	}
+	#else
+	if (pin)
+		fprintf(stderr, "ev_zsock_pool: pinning is not supported, not pinning\n");
+	#endif
+
+	if (nloops <= 0)
+		nloops = ncpus;
+
+	ev_zsock_pool_t *pool = (ev_zsock_pool_t *)s_malloc(sizeof(*pool));
+	pool->nloops = nloops;
+	pool->loops = (s_pool_loop_t *)s_malloc(nloops * sizeof(*pool->loops));
+
+	int idx;
+	for (idx=0; idx < nloops; idx++) {
+		s_pool_loop_t *pl = &pool->loops[idx];
+		pl->pool = pool;
+		pl->index = idx;
+		pl->cpu = pin && nallowed ? cpus[idx % nallowed] : -1;
+
+		pl->loop = ev_loop_new(0);
+		assert(pl->loop);
+		ev_set_userdata(pl->loop, pl);
+		ev_set_loop_release_cb(pl->loop, s_release_cb, s_acquire_cb);
+
+		// keeps the loop running while it has no sockets
+		ev_async_init(&pl->w_jobs, s_jobs_cb);
+		ev_async_start(pl->loop, &pl->w_jobs);
+		pthread_mutex_init(&pl->mutex, NULL);
+		pl->jobs_head = NULL;
+		pl->jobs_tail = NULL;
+
+		pl->assigned = 0;
+		pl->wakeups = 0;
+		pl->idle_ns = 0;
+		pl->t_started = 0.;
+		pl->t_blocked = 0.;
+	}
+
+	for (idx=0; idx < nloops; idx++) {
+		s_pool_loop_t *pl = &pool->loops[idx];
+		int rc = pthread_create(&pl->thread, NULL, s_thread_main, pl);
+		assert(rc==0);
+	}
+
+	free(cpus);
+	return pool;
+}
+
+void
+ev_zsock_pool_destroy(ev_zsock_pool_t **pool_p)
+{
+	ev_zsock_pool_t *pool = *pool_p;
+	if (!pool)
+		return;
+
+	int idx;
+	for (idx=0; idx < pool->nloops; idx++)
+		s_post(&pool->loops[idx], s_break_fn, NULL, NULL);
+
+	for (idx=0; idx < pool->nloops; idx++)
+		pthread_join(pool->loops[idx].thread, NULL);
+
+	// jobs posted after the break, which may post more. the loops are
+	// no longer run by anyone, so they are ours now.
+	int ran;
+	do {
+		ran = 0;
+		for (idx=0; idx < pool->nloops; idx++)
+			ran += s_run_jobs(&pool->loops[idx]);
+	} while (ran);
+
+	for (idx=0; idx < pool->nloops; idx++) {
+		s_pool_loop_t *pl = &pool->loops[idx];
+		ev_async_stop(pl->loop, &pl->w_jobs);
+		ev_zsock_registry_destroy(pl->loop);
+		ev_loop_destroy(pl->loop);
+		pthread_mutex_destroy(&pl->mutex);
+	}
+
+	free(pool->loops);
+	free(pool);
+	*pool_p = NULL;
+}
+
+int
+ev_zsock_pool_size(ev_zsock_pool_t *pool)
+{
+	return pool->nloops;
+}
+
+struct ev_loop *
+ev_zsock_pool_loop(ev_zsock_pool_t *pool, int index)
+{
+	assert(index >= 0 && index < pool->nloops);
+	return pool->loops[index].loop;
+}
+
+int
+ev_zsock_pool_index(ev_zsock_pool_t *pool, uint64_t key)
+{
+	// mix the bits first, keys are often small sequential ids
+	uint64_t hash = key * 0x9E3779B97F4A7C15ull;
+	return (int)((hash >> 32) % (uint64_t)pool->nloops);
+}
+
+void
+ev_zsock_pool_run(ev_zsock_pool_t *pool, int index,
+		ev_zsock_pool_fn fn, void *arg)
+{
+	assert(index >= 0 && index < pool->nloops);
+	s_post(&pool->loops[index], fn, arg, NULL);
+}
+
+static
+void s_assign_fn(struct ev_loop *loop, void *arg)
+{
+	s_pool_loop_t *pl = s_pool_loop(loop);
+	ev_zsock_start(loop, (ev_zsock_t *)arg);
+	__atomic_store_n(&pl->assigned, pl->assigned + 1, __ATOMIC_RELAXED);
+}
+
+static
+void s_release_fn(struct ev_loop *loop, void *arg)
+{
+	s_pool_loop_t *pl = s_pool_loop(loop);
+	ev_zsock_stop(loop, (ev_zsock_t *)arg);
+	__atomic_store_n(&pl->assigned, pl->assigned - 1, __ATOMIC_RELAXED);
+}
+
+int
+ev_zsock_pool_assign(ev_zsock_pool_t *pool, ev_zsock_t *wz, uint64_t key)
+{
+	int index = ev_zsock_pool_index(pool, key);
+	s_post(&pool->loops[index], s_assign_fn, wz, NULL);
+	return index;
+}
+
+void
+ev_zsock_pool_release(ev_zsock_pool_t *pool, int index, ev_zsock_t *wz,
+		ev_zsock_pool_fn done)
+{
+	assert(index >= 0 && index < pool->nloops);
+	s_post(&pool->loops[index], s_release_fn, wz, done);
+}
+
+void
+ev_zsock_pool_stats(ev_zsock_pool_t *pool, int index,
+		ev_zsock_pool_stats_t *stats)
+{
+	assert(index >= 0 && index < pool->nloops);
+	s_pool_loop_t *pl = &pool->loops[index];
+
+	stats->assigned = __atomic_load_n(&pl->assigned, __ATOMIC_RELAXED);
+	stats->wakeups = __atomic_load_n(&pl->wakeups, __ATOMIC_RELAXED);
+	stats->idle_ns = __atomic_load_n(&pl->idle_ns, __ATOMIC_RELAXED);
+	stats->cpu = __atomic_load_n(&pl->cpu, __ATOMIC_RELAXED);
+
+	ev_tstamp t_started;
+	__atomic_load(&pl->t_started, &t_started, __ATOMIC_RELAXED);
+	stats->run_ns = t_started > 0. ? (uint64_t)((ev_time() - t_started) * 1e9) : 0;
+}
@@ -0,0 +1,69 @@
+#ifndef EV_ZSOCK_POOL_H_
+#define EV_ZSOCK_POOL_H_
+
+#include <stdint.h>
+
+#include <ev.h>
+#include <zmq.h>
+
+#include "ev_zsock.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// N libev loops, each run by its own thread, optionally pinned to a core.
+// a socket belongs to the one loop it was assigned to: from then on it
+// must only be used from that loop's callbacks or from jobs run on it.
+// POSIX threads only.
+
+struct ev_zsock_pool_t;
+typedef struct ev_zsock_pool_t ev_zsock_pool_t;
+
+typedef void (*ev_zsock_pool_fn)(struct ev_loop *loop, void *arg);
+
+typedef struct
+{
+	int assigned;		// sockets assigned minus released
+	uint64_t wakeups;	// times the loop woke up
+	uint64_t idle_ns;	// time spent blocked waiting for events
+	uint64_t run_ns;	// time since the loop thread started
+	int cpu;		// the loop's thread is pinned to, -1 if not
+} ev_zsock_pool_stats_t;
+
+// nloops <= 0 means one per cpu the process may run on. with pin, loop i
+// runs on the i-th of those cpus (Linux only). a thread that cannot be
+// pinned says so on stderr, runs unpinned and reports cpu -1.
+ev_zsock_pool_t *ev_zsock_pool_new(int nloops, int pin);
+// stops and joins the threads, runs the jobs still queued (release's done
+// included) on the calling thread, then stops the watchers left on the loops
+void ev_zsock_pool_destroy(ev_zsock_pool_t **pool_p);
+
+int ev_zsock_pool_size(ev_zsock_pool_t *pool);
+struct ev_loop *ev_zsock_pool_loop(ev_zsock_pool_t *pool, int index);
+// the loop that owns the sockets of a key, e.g. a hash of a peer id
+int ev_zsock_pool_index(ev_zsock_pool_t *pool, uint64_t key);
+
+// runs fn(loop, arg) on the thread of loop index, asynchronously unless
+// called from that thread. jobs run in the order they were posted.
+void ev_zsock_pool_run(ev_zsock_pool_t *pool, int index,
+		ev_zsock_pool_fn fn, void *arg);
+
+// hands the socket of an initialised watcher over to the loop of key and
+// starts the watcher there. returns the loop index.
+int ev_zsock_pool_assign(ev_zsock_pool_t *pool, ev_zsock_t *wz, uint64_t key);
+// stops the watcher on its loop, after which the socket may move again.
+// done is then called on the loop thread if not NULL.
+void ev_zsock_pool_release(ev_zsock_pool_t *pool, int index, ev_zsock_t *wz,
+		ev_zsock_pool_fn done);
+
+// counters of loop index, readable from any thread
+void ev_zsock_pool_stats(ev_zsock_pool_t *pool, int index,
+		ev_zsock_pool_stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
@@ -0,0 +1,143 @@
+#include <assert.h>
+#include <errno.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <ev.h>
+#include <zmq.h>
+
+#include "ev_zsock_send_queue.h"
+
+struct ev_zsock_send_queue_entry_t
+{
+	zmq_msg_t msg;
+	int flags;
+};
+
+static
+void s_flush(ev_zsock_send_queue_t *q)
+{
+	while (q->count > 0) {
+		ev_zsock_send_queue_entry_t *entry = &q->ring[q->head];
+		int rc = -1;
+		if (!q->dropping) {
+			rc = zmq_msg_send(&entry->msg, q->zsock, entry->flags | ZMQ_DONTWAIT);
+			if (rc==-1 && zmq_errno()==EAGAIN)
+				break;
+		}
+		if (rc==-1) {
+			// the socket will not take it, drop the whole message
+			// rather than blocking everything queued behind it.
+			// its remaining frames must not go out as a message.
+			zmq_msg_close(&entry->msg);
+			q->dropping = (entry->flags & ZMQ_SNDMORE) != 0;
+		}
+
+		q->head = (q->head + 1) % q->capacity;
+		q->count--;
+	}
+}
+
+static
+void s_zsock_cb(struct ev_loop *loop, ev_zsock_t *wz, int revents)
+{
+	ev_zsock_send_queue_t *q = (ev_zsock_send_queue_t *)
+		(((char *)wz) - offsetof(ev_zsock_send_queue_t, w_zsock));
+
+	s_flush(q);
+
+	if (q->count==0) {
+		// write interest only while there is something to write
+		ev_zsock_stop(loop, &q->w_zsock);
+	}
+
+	if (q->above && q->count <= q->lwm) {
+		q->above = 0;
+		if (q->cb)	q->cb(loop, q, 0);
+	}
+}
+
+void
+ev_zsock_send_queue_init(ev_zsock_send_queue_t *q, struct ev_loop *loop,
+		void *zsock, int capacity, int hwm, int lwm, ev_zsock_send_queue_cbfn cb)
+{
+	assert(capacity > 0);
+	assert(lwm < hwm && hwm <= capacity);
+
+	q->cb = cb;
+	q->zsock = zsock;
+	q->capacity = capacity;
+	q->hwm = hwm;
+	q->lwm = lwm;
+	q->count = 0;
+
+	q->loop = loop;
+	q->head = 0;
+	q->above = 0;
+	q->dropping = 0;
+
+	q->ring = (ev_zsock_send_queue_entry_t *)malloc(capacity * sizeof(*q->ring));
+	if (!q->ring) {
+		fprintf(stderr, "ev_zsock: memory allocation failed, aborting\n");
+		abort();
+	}
+
+	ev_zsock_init(&q->w_zsock, s_zsock_cb, zsock, EV_WRITE);
+}
+
+void
+ev_zsock_send_queue_destroy(ev_zsock_send_queue_t *q)
+{
+	ev_zsock_stop(q->loop, &q->w_zsock);
+
+	while (q->count > 0) {
+		zmq_msg_close(&q->ring[q->head].msg);
+		q->head = (q->head + 1) % q->capacity;
+		q->count--;
+	}
+
+	free(q->ring);
+	q->ring = NULL;
+}
+
+int
+ev_zsock_send_queue_send(ev_zsock_send_queue_t *q, zmq_msg_t *msg, int flags)
+{
+	if (q->count==0 && q->dropping) {
+		// the tail of a message that was dropped while queued
+		zmq_msg_close(msg);
+		zmq_msg_init(msg);
+		q->dropping = (flags & ZMQ_SNDMORE) != 0;
+		return 0;
+	}
+
+	if (q->count==0) {
+		if (zmq_msg_send(msg, q->zsock, flags | ZMQ_DONTWAIT) != -1)
+			return 0;
+		if (zmq_errno() != EAGAIN)
+			return -1;
+	}
+
+	if (q->count==q->capacity) {
+		errno = EAGAIN;
+		return -1;
+	}
+
+	ev_zsock_send_queue_entry_t *entry = &q->ring[(q->head + q->count) % q->capacity];
+	zmq_msg_init(&entry->msg);
+	zmq_msg_move(&entry->msg, msg);
+	entry->flags = flags & ~ZMQ_DONTWAIT;
+	q->count++;
+
+	if (q->count==1)
+		ev_zsock_start(q->loop, &q->w_zsock);
+
+	if (!q->above && q->count >= q->hwm) {
+		q->above = 1;
+		if (q->cb)	q->cb(q->loop, q, 1);
+	}
+
+	return 0;
+}
+
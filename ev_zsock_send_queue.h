@@ -0,0 +1,61 @@
+#ifndef EV_ZSOCK_SEND_QUEUE_H_
+#define EV_ZSOCK_SEND_QUEUE_H_
+
+#include <ev.h>
+#include <zmq.h>
+
+#include "ev_zsock.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct ev_zsock_send_queue_t;
+typedef struct ev_zsock_send_queue_t ev_zsock_send_queue_t;
+
+// called with above=1 when the queue fills up to hwm,
+// then with above=0 once it has drained down to lwm
+typedef void (*ev_zsock_send_queue_cbfn)(struct ev_loop *loop,
+		ev_zsock_send_queue_t *q, int above);
+
+struct ev_zsock_send_queue_entry_t;
+typedef struct ev_zsock_send_queue_entry_t ev_zsock_send_queue_entry_t;
+
+struct ev_zsock_send_queue_t
+{
+	void *data;		// rw
+
+	ev_zsock_send_queue_cbfn cb;	// read-only
+	void *zsock;		// read-only
+	int capacity;		// read-only
+	int hwm;		// read-only
+	int lwm;		// read-only
+	int count;		// read-only, messages waiting in the queue
+
+	// private
+	ev_zsock_t w_zsock;
+	struct ev_loop *loop;
+	ev_zsock_send_queue_entry_t *ring;
+	int head;
+	int above;
+	int dropping;		// the rest of a message whose frame failed
+};
+
+void ev_zsock_send_queue_init(ev_zsock_send_queue_t *q, struct ev_loop *loop,
+		void *zsock, int capacity, int hwm, int lwm, ev_zsock_send_queue_cbfn cb);
+// closes the messages still queued
+void ev_zsock_send_queue_destroy(ev_zsock_send_queue_t *q);
+
+// same contract as zmq_msg_send(): on success the queue owns the content
+// of msg. the message is sent right away if nothing is queued and the
+// socket accepts it. returns -1 with errno EAGAIN if the queue is full.
+// a queued frame that the socket refuses with another error is dropped
+// along with the rest of its message, including frames sent later.
+int ev_zsock_send_queue_send(ev_zsock_send_queue_t *q, zmq_msg_t *msg, int flags);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
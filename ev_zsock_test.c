@@ -3,10 +3,18 @@
 #include <string.h>
 #include <stdlib.h>
 
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
 #include <ev.h>
 #include <zmq.h>
 
 #include "ev_zsock.h"
+#include "ev_zsock_send_queue.h"
+#ifndef _WIN32
+#include "ev_zsock_pool.h"
+#endif
 
 static void
 sigint_cb(struct ev_loop *loop, ev_signal *w, int revents)
@@ -31,8 +39,600 @@ void zsock_cb(struct ev_loop *loop, ev_zsock_t *wz, int revents)
 	printf("%f\n", ts_recv - ts_send);
 }
 
-int main()
+// self checks, each on a fresh loop with its own PUSH/PULL pairs
+
+#define NPAIRS 4
+
+typedef struct {
+	void *zctx;
+	struct ev_loop *loop;
+	void *pull[NPAIRS];
+	void *push[NPAIRS];
+	int calls;
+	int got[NPAIRS];	// messages, per pair
+	int order[16];		// pairs, in the order they were called
+	int norder;
+	zmq_msg_t *kept;
+	ev_zsock_t *wz;		// one per pair, for the callbacks to find theirs
+} check_t;
+
+static void
+s_check_setup(check_t *check)
+{
+	static int endpoint = 0;
+
+	check->zctx = zmq_ctx_new();
+	check->loop = ev_loop_new(0);
+	check->calls = 0;
+	memset(check->got, 0, sizeof(check->got));
+	check->norder = 0;
+	check->kept = NULL;
+	check->wz = NULL;
+
+	int idx;
+	for (idx=0; idx < NPAIRS; idx++) {
+		char addr[32];
+		snprintf(addr, sizeof(addr), "inproc://check%d", endpoint++);
+		check->pull[idx] = zmq_socket(check->zctx, ZMQ_PULL);
+		int rc = zmq_bind(check->pull[idx], addr);
+		assert(rc!=-1);
+		check->push[idx] = zmq_socket(check->zctx, ZMQ_PUSH);
+		rc = zmq_connect(check->push[idx], addr);
+		assert(rc!=-1);
+	}
+}
+
+static void
+s_check_teardown(check_t *check)
+{
+	ev_zsock_registry_destroy(check->loop);
+	ev_loop_destroy(check->loop);
+
+	int idx;
+	for (idx=0; idx < NPAIRS; idx++) {
+		zmq_close(check->pull[idx]);
+		zmq_close(check->push[idx]);
+	}
+	zmq_ctx_destroy(check->zctx);
+}
+
+static void
+s_run_a_few(check_t *check)
+{
+	int iter;
+	for (iter=0; iter < 4; iter++)
+		ev_run(check->loop, EVRUN_NOWAIT);
+}
+
+// a callback may stop and free its own watcher, whatever the mode
+
+static void
+s_free_cb(struct ev_loop *loop, ev_zsock_t *wz, int revents)
+{
+	check_t *check = (check_t *)wz->data;
+	check->calls++;
+	ev_zsock_stop(loop, wz);
+	free(wz);
+}
+
+static void
+s_free_drain_cb(struct ev_loop *loop, ev_zsock_t *wz, zmq_msg_t *msgs, int count)
 {
+	s_free_cb(loop, wz, EV_READ);
+}
+
+static void
+s_free_multipart_cb(struct ev_loop *loop, ev_zsock_t *wz,
+		const ev_zsock_frame_t *frames, zmq_msg_t *msgs, int count)
+{
+	s_free_cb(loop, wz, EV_READ);
+}
+
+static void
+s_check_self_free(void)
+{
+	check_t check;
+	s_check_setup(&check);
+	ev_zsock_set_budget(check.loop, EV_ZSOCK_MSGS, 100);
+
+	int idx;
+	for (idx=0; idx < NPAIRS; idx++) {
+		zmq_send(check.push[idx], "a", 1, 0);
+		zmq_send(check.push[idx], "b", 1, 0);
+
+		ev_zsock_t *wz = (ev_zsock_t *)malloc(sizeof(*wz));
+		ev_zsock_init(wz, s_free_cb, check.pull[idx], EV_READ);
+		wz->data = &check;
+		if (idx==1)
+			ev_zsock_set_drain(wz, s_free_drain_cb, 8, 0);
+		if (idx==2)
+			ev_zsock_set_multipart(wz, s_free_multipart_cb, 8);
+		ev_zsock_set_quantum(wz, 4);
+		ev_zsock_start(check.loop, wz);
+	}
+
+	s_run_a_few(&check);
+	assert(check.calls==NPAIRS);
+
+	s_check_teardown(&check);
+}
+
+// whole messages only, frame i of a message being i bytes of i
+
+static void
+s_multipart_cb(struct ev_loop *loop, ev_zsock_t *wz,
+		const ev_zsock_frame_t *frames, zmq_msg_t *msgs, int count)
+{
+	check_t *check = (check_t *)wz->data;
+
+	int idx;
+	for (idx=0; idx < count; idx++) {
+		assert(frames[idx].size==(size_t)idx);
+		assert(idx==0 || ((char *)frames[idx].data)[idx - 1]==idx);
+	}
+	assert(count==check->calls % 40 + 1);
+	check->calls++;
+}
+
+static void
+s_check_multipart(void)
+{
+	check_t check;
+	s_check_setup(&check);
+
+	int msg;
+	for (msg=0; msg < 400; msg++) {
+		int nframes = msg % 40 + 1;
+		int idx;
+		for (idx=0; idx < nframes; idx++) {
+			char buf[64];
+			memset(buf, idx, sizeof(buf));
+			zmq_send(check.push[0], buf, idx, idx < nframes - 1 ? ZMQ_SNDMORE : 0);
+		}
+	}
+
+	ev_zsock_t wz;
+	ev_zsock_init(&wz, NULL, check.pull[0], EV_READ);
+	wz.data = &check;
+	ev_zsock_set_multipart(&wz, s_multipart_cb, 16);
+	ev_zsock_start(check.loop, &wz);
+
+	while (check.calls < 400)
+		ev_run(check.loop, EVRUN_NOWAIT);
+	assert(wz.drained <= 16);
+
+	ev_zsock_stop(check.loop, &wz);
+	s_check_teardown(&check);
+}
+
+// a terminated context is reported once, then the watcher is stopped
+
+static void
+s_error_cb(struct ev_loop *loop, ev_zsock_t *wz, int revents)
+{
+	check_t *check = (check_t *)wz->data;
+	assert(revents & EV_ERROR);
+	assert(ev_zsock_is_parked(wz));
+	check->calls++;
+}
+
+static void
+s_check_terminated(void)
+{
+	check_t check;
+	s_check_setup(&check);
+
+	ev_zsock_t wz;
+	ev_zsock_init(&wz, s_error_cb, check.pull[0], EV_READ);
+	wz.data = &check;
+	ev_zsock_start(check.loop, &wz);
+
+	s_run_a_few(&check);
+	assert(check.calls==0);
+
+	zmq_ctx_shutdown(check.zctx);
+	s_run_a_few(&check);
+	assert(check.calls==1 && wz.errors==1);
+	assert(wz.index < 0 && !ev_zsock_is_parked(&wz));
+
+	s_check_teardown(&check);
+}
+
+// drain mode: up to max_msgs per wakeup, a kept message outlives it
+
+static void
+s_drain_cb(struct ev_loop *loop, ev_zsock_t *wz, zmq_msg_t *msgs, int count)
+{
+	check_t *check = (check_t *)wz->data;
+
+	assert(count <= 16 && wz->drained==count);
+	int idx;
+	for (idx=0; idx < count; idx++)
+		assert(*(char *)zmq_msg_data(&msgs[idx])==(char)(check->got[0] + idx));
+
+	if (!check->kept)
+		check->kept = ev_zsock_msg_keep(wz, &msgs[0]);
+	check->got[0] += count;
+	check->calls++;
+}
+
+static void
+s_check_drain(void)
+{
+	check_t check;
+	s_check_setup(&check);
+
+	char idx;
+	for (idx=0; idx < 100; idx++)
+		zmq_send(check.push[0], &idx, 1, 0);
+
+	ev_zsock_t wz;
+	ev_zsock_init(&wz, NULL, check.pull[0], EV_READ);
+	wz.data = &check;
+	ev_zsock_set_drain(&wz, s_drain_cb, 16, 0);
+	ev_zsock_start(check.loop, &wz);
+
+	while (check.got[0] < 100)
+		ev_run(check.loop, EVRUN_NOWAIT);
+	assert(check.calls >= 7);
+
+	assert(zmq_msg_size(check.kept)==1 && *(char *)zmq_msg_data(check.kept)==0);
+	ev_zsock_msg_release(&wz, check.kept);
+
+	ev_zsock_stop(check.loop, &wz);
+	ev_zsock_msg_pool_destroy(&wz);
+	s_check_teardown(&check);
+}
+
+// an always writable socket is reported once until rearmed
+
+static void
+s_count_cb(struct ev_loop *loop, ev_zsock_t *wz, int revents)
+{
+	check_t *check = (check_t *)wz->data;
+	check->calls++;
+}
+
+static void
+s_check_oneshot(void)
+{
+	check_t check;
+	s_check_setup(&check);
+
+	ev_zsock_t wz;
+	ev_zsock_init(&wz, s_count_cb, check.push[0], EV_WRITE);
+	wz.data = &check;
+	ev_zsock_set_oneshot(&wz, EV_WRITE);
+	ev_zsock_start(check.loop, &wz);
+
+	s_run_a_few(&check);
+	assert(check.calls==1 && !(wz.events & EV_WRITE));
+
+	ev_zsock_rearm(&wz, EV_WRITE);
+	s_run_a_few(&check);
+	assert(check.calls==2);
+
+	ev_zsock_stop(check.loop, &wz);
+	s_check_teardown(&check);
+}
+
+// a lazy watcher is called while its socket stays readable, one message
+// at a time here, and not once it is empty
+
+static void
+s_lazy_cb(struct ev_loop *loop, ev_zsock_t *wz, int revents)
+{
+	check_t *check = (check_t *)wz->data;
+	char buf[8];
+	if (ev_zsock_recv(wz, buf, sizeof(buf), ZMQ_DONTWAIT) >= 0)
+		check->got[0]++;
+	check->calls++;
+}
+
+static void
+s_check_lazy(void)
+{
+	check_t check;
+	s_check_setup(&check);
+
+	ev_zsock_t wz;
+	ev_zsock_init(&wz, s_lazy_cb, check.pull[0], EV_READ);
+	wz.data = &check;
+	ev_zsock_set_lazy(&wz, 1);
+	ev_zsock_start(check.loop, &wz);
+
+	int idx;
+	for (idx=0; idx < 3; idx++)
+		zmq_send(check.push[0], "x", 1, 0);
+
+	int iter;
+	for (iter=0; iter < 10 && check.got[0] < 3; iter++)
+		ev_run(check.loop, EVRUN_NOWAIT);
+	assert(check.got[0]==3);
+
+	int calls = check.calls;
+	s_run_a_few(&check);
+	assert(check.calls==calls);
+
+	ev_zsock_stop(check.loop, &wz);
+	s_check_teardown(&check);
+}
+
+// higher priorities first, and deficit round robin among equals
+
+static void
+s_order_cb(struct ev_loop *loop, ev_zsock_t *wz, int revents)
+{
+	check_t *check = (check_t *)wz->data;
+	int pair = (int)(wz - check->wz);
+	char buf[8];
+	while (ev_zsock_recv(wz, buf, sizeof(buf), ZMQ_DONTWAIT) >= 0)
+		;
+	check->order[check->norder++] = pair;
+}
+
+static void
+s_quantum_cb(struct ev_loop *loop, ev_zsock_t *wz, zmq_msg_t *msgs, int count)
+{
+	check_t *check = (check_t *)wz->data;
+	check->got[wz - check->wz] += count;
+}
+
+static void
+s_check_priority(void)
+{
+	check_t check;
+	s_check_setup(&check);
+
+	ev_zsock_t wz[NPAIRS];
+	check.wz = wz;
+
+	int idx;
+	for (idx=0; idx < NPAIRS; idx++) {
+		zmq_send(check.push[idx], "x", 1, 0);
+		ev_zsock_init(&wz[idx], s_order_cb, check.pull[idx], EV_READ);
+		wz[idx].data = &check;
+		ev_zsock_set_priority(&wz[idx], EV_ZSOCK_MINPRI + idx);
+		ev_zsock_start(check.loop, &wz[idx]);
+	}
+
+	s_run_a_few(&check);
+	assert(check.norder==NPAIRS);
+	for (idx=0; idx < NPAIRS; idx++)
+		assert(check.order[idx]==NPAIRS - 1 - idx);
+
+	// pairs 0 and 1 busy, served 3:1 per iteration
+	for (idx=0; idx < 2; idx++) {
+		int msg;
+		for (msg=0; msg < 200; msg++)
+			zmq_send(check.push[idx], "x", 1, 0);
+		ev_zsock_set_priority(&wz[idx], 0);
+		ev_zsock_set_drain(&wz[idx], s_quantum_cb, 64, 0);
+		ev_zsock_set_quantum(&wz[idx], idx==0 ? 3 : 1);
+	}
+
+	int iter;
+	for (iter=0; iter < 10; iter++)
+		ev_run(check.loop, EVRUN_NOWAIT);
+	assert(check.got[0]==30 && check.got[1]==10);
+
+	// and at most 4 messages per iteration in total
+	ev_zsock_set_budget(check.loop, EV_ZSOCK_MSGS, 4);
+	ev_zsock_set_quantum(&wz[0], 0);
+	ev_zsock_set_quantum(&wz[1], 0);
+	ev_run(check.loop, EVRUN_NOWAIT);
+	assert(check.got[0] + check.got[1]==44);
+
+	for (idx=0; idx < NPAIRS; idx++)
+		ev_zsock_stop(check.loop, &wz[idx]);
+	s_check_teardown(&check);
+}
+
+// the send queue crosses its watermarks once each way, keeps the order,
+// and drops a refused message whole
+
+static void
+s_watermark_cb(struct ev_loop *loop, ev_zsock_send_queue_t *q, int above)
+{
+	check_t *check = (check_t *)q->data;
+	check->order[check->norder++] = above;
+}
+
+static void
+s_queue_send(ev_zsock_send_queue_t *q, const char *str, int flags)
+{
+	zmq_msg_t msg;
+	zmq_msg_init_size(&msg, strlen(str));
+	memcpy(zmq_msg_data(&msg), str, strlen(str));
+	int rc = ev_zsock_send_queue_send(q, &msg, flags);
+	assert(rc==0);
+}
+
+static void
+s_check_send_queue(void)
+{
+	check_t check;
+	s_check_setup(&check);
+
+	int hwm = 4;
+	void *push = zmq_socket(check.zctx, ZMQ_PUSH);
+	void *pull = zmq_socket(check.zctx, ZMQ_PULL);
+	zmq_setsockopt(push, ZMQ_SNDHWM, &hwm, sizeof(hwm));
+	zmq_setsockopt(pull, ZMQ_RCVHWM, &hwm, sizeof(hwm));
+	zmq_bind(pull, "inproc://check-queue");
+	zmq_connect(push, "inproc://check-queue");
+
+	ev_zsock_send_queue_t q;
+	ev_zsock_send_queue_init(&q, check.loop, push, 100, 80, 10, s_watermark_cb);
+	q.data = &check;
+
+	int idx;
+	for (idx=0; idx < 100; idx++) {
+		char buf[16];
+		snprintf(buf, sizeof(buf), "%d", idx);
+		s_queue_send(&q, buf, 0);
+	}
+	assert(q.count >= 80 && check.norder==1 && check.order[0]==1);
+
+	int received = 0;
+	while (received < 100) {
+		ev_run(check.loop, EVRUN_NOWAIT);
+		char buf[16], expect[16];
+		int size;
+		while ((size = zmq_recv(pull, buf, sizeof(buf) - 1, ZMQ_DONTWAIT)) >= 0) {
+			buf[size] = 0;
+			snprintf(expect, sizeof(expect), "%d", received++);
+			assert(!strcmp(buf, expect));
+		}
+	}
+	assert(q.count==0 && check.norder==2 && check.order[1]==0);
+	ev_zsock_send_queue_destroy(&q);
+
+	// the tail of a message to an unknown peer must not reach A
+	int one = 1;
+	void *router = zmq_socket(check.zctx, ZMQ_ROUTER);
+	void *dealer = zmq_socket(check.zctx, ZMQ_DEALER);
+	zmq_setsockopt(router, ZMQ_ROUTER_MANDATORY, &one, sizeof(one));
+	zmq_setsockopt(router, ZMQ_SNDHWM, &hwm, sizeof(hwm));
+	zmq_setsockopt(dealer, ZMQ_RCVHWM, &hwm, sizeof(hwm));
+	zmq_setsockopt(dealer, ZMQ_ROUTING_ID, "A", 1);
+	zmq_bind(router, "inproc://check-router");
+	zmq_connect(dealer, "inproc://check-router");
+
+	ev_zsock_send_queue_init(&q, check.loop, router, 100, 90, 10, NULL);
+	int sent = 0;
+	while (q.count==0) {
+		s_queue_send(&q, "A", ZMQ_SNDMORE);
+		s_queue_send(&q, "fill", 0);
+		sent++;
+	}
+	s_queue_send(&q, "B", ZMQ_SNDMORE);
+	s_queue_send(&q, "A", ZMQ_SNDMORE);
+	s_queue_send(&q, "stray", 0);
+	s_queue_send(&q, "A", ZMQ_SNDMORE);
+	s_queue_send(&q, "end", 0);
+
+	received = 0;
+	for (;;) {
+		ev_run(check.loop, EVRUN_NOWAIT);
+		char buf[8];
+		int size = zmq_recv(dealer, buf, sizeof(buf), ZMQ_DONTWAIT);
+		if (size < 0)
+			continue;
+		if (size==3 && !memcmp(buf, "end", 3))
+			break;
+		assert(size==4 && !memcmp(buf, "fill", 4));
+		received++;
+	}
+	assert(received==sent);
+	ev_zsock_send_queue_destroy(&q);
+
+	zmq_close(push);
+	zmq_close(pull);
+	zmq_close(router);
+	zmq_close(dealer);
+	s_check_teardown(&check);
+}
+
+#ifndef _WIN32
+
+// sockets move to a pool loop and back, and jobs left queued when the
+// pool is destroyed still run
+
+static ev_zsock_pool_t *s_pool;
+static int s_pool_count;
+static int s_pool_released;
+
+static void
+s_pool_cb(struct ev_loop *loop, ev_zsock_t *wz, int revents)
+{
+	char buf[8];
+	while (zmq_recv(wz->zsock, buf, sizeof(buf), ZMQ_DONTWAIT) >= 0)
+		__atomic_add_fetch(&s_pool_count, 1, __ATOMIC_SEQ_CST);
+}
+
+static void
+s_pool_done(struct ev_loop *loop, void *arg)
+{
+	__atomic_store_n(&s_pool_released, 1, __ATOMIC_SEQ_CST);
+}
+
+static void
+s_pool_late(struct ev_loop *loop, void *arg)
+{
+	(*(int *)arg)++;
+}
+
+static void
+s_pool_slow(struct ev_loop *loop, void *arg)
+{
+	// the other loop has broken out by then
+	usleep(50000);
+	ev_zsock_pool_run(s_pool, 1, s_pool_late, arg);
+}
+
+static void
+s_check_pool(void)
+{
+	check_t check;
+	s_check_setup(&check);
+
+	s_pool = ev_zsock_pool_new(2, 0);
+	assert(ev_zsock_pool_size(s_pool)==2);
+
+	ev_zsock_t wz;
+	ev_zsock_init(&wz, s_pool_cb, check.pull[0], EV_READ);
+	int index = ev_zsock_pool_assign(s_pool, &wz, 42);
+	assert(index==ev_zsock_pool_index(s_pool, 42));
+
+	int idx;
+	for (idx=0; idx < 100; idx++)
+		zmq_send(check.push[0], "x", 1, 0);
+	while (__atomic_load_n(&s_pool_count, __ATOMIC_SEQ_CST) < 100)
+		usleep(1000);
+
+	ev_zsock_pool_release(s_pool, index, &wz, s_pool_done);
+	while (!__atomic_load_n(&s_pool_released, __ATOMIC_SEQ_CST))
+		usleep(1000);
+
+	ev_zsock_pool_stats_t stats;
+	ev_zsock_pool_stats(s_pool, index, &stats);
+	assert(stats.assigned==0 && stats.cpu==-1);
+
+	int late = 0;
+	ev_zsock_pool_run(s_pool, 0, s_pool_slow, &late);
+	ev_zsock_pool_destroy(&s_pool);
+	assert(late==1);
+
+	s_check_teardown(&check);
+}
+
+#endif
+
+static void
+s_checks(void)
+{
+	s_check_self_free();
+	s_check_drain();
+	s_check_multipart();
+	s_check_oneshot();
+	s_check_lazy();
+	s_check_priority();
+	s_check_send_queue();
+	#ifndef _WIN32
+	s_check_pool();
+	#endif
+	s_check_terminated();
+	printf("checks passed\n");
+}
+
+// with -c, only runs the self checks
+int main(int argc, char **argv)
+{
+	s_checks();
+	if (argc > 1 && !strcmp(argv[1], "-c"))
+		return 0;
+
 	struct ev_loop *loop = ev_default_loop(0);
 	ev_signal signal_watcher;
 	ev_signal *p_signal_watcher = &signal_watcher;
@@ -0,0 +1,71 @@
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+#include "latency_hist.h"
+
+void
+latency_hist_reset(latency_hist_t *hist)
+{
+	memset(hist, 0, sizeof(*hist));
+}
+
+uint64_t
+latency_hist_bucket_value(int bucket)
+{
+	if (bucket < (1 << LATENCY_HIST_SUB_BITS))
+		return bucket;
+
+	int shift = (bucket >> LATENCY_HIST_SUB_BITS) - 1;
+	uint64_t mantissa = (1u << LATENCY_HIST_SUB_BITS)
+		+ (bucket & ((1u << LATENCY_HIST_SUB_BITS) - 1));
+	return mantissa << shift;
+}
+
+uint64_t
+latency_hist_percentile(const latency_hist_t *hist, double pct)
+{
+	if (hist->count==0)
+		return 0;
+
+	uint64_t target = (uint64_t)(hist->count * pct / 100.0 + 0.5);
+	if (target < 1)
+		target = 1;
+
+	uint64_t seen = 0;
+	int bucket;
+	for (bucket=0; bucket < LATENCY_HIST_BUCKETS; bucket++) {
+		seen += hist->buckets[bucket];
+		if (seen >= target)
+			break;
+	}
+
+	if (bucket >= LATENCY_HIST_BUCKETS - 1)
+		return hist->max;
+
+	// upper edge of the bucket, but never beyond what was recorded
+	uint64_t value = latency_hist_bucket_value(bucket + 1) - 1;
+	return value < hist->max ? value : hist->max;
+}
+
+uint64_t
+latency_hist_now(void)
+{
+	#ifdef _WIN32
+	static LARGE_INTEGER freq;
+	LARGE_INTEGER count;
+	if (freq.QuadPart==0)
+		QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&count);
+	return (uint64_t)(count.QuadPart * (1e9 / freq.QuadPart));
+	#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+	#endif
+}
+
@@ -0,0 +1,80 @@
+#ifndef LATENCY_HIST_H_
+#define LATENCY_HIST_H_
+
+#include <stdint.h>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// log-linear histogram of nanosecond intervals, HDR style:
+// 8 linear sub-buckets per power of two, i.e. within 12.5% of the value.
+// values of 2^40 ns (about 18 minutes) and above go to the last bucket.
+
+#define LATENCY_HIST_SUB_BITS	3
+#define LATENCY_HIST_MAX_BITS	40
+#define LATENCY_HIST_BUCKETS	((LATENCY_HIST_MAX_BITS - LATENCY_HIST_SUB_BITS + 1) << LATENCY_HIST_SUB_BITS)
+
+struct latency_hist_t;
+typedef struct latency_hist_t latency_hist_t;
+
+struct latency_hist_t
+{
+	uint64_t count;
+	uint64_t sum;
+	uint64_t min;
+	uint64_t max;
+	uint32_t buckets[LATENCY_HIST_BUCKETS];
+};
+
+void latency_hist_reset(latency_hist_t *hist);
+// smallest value v such that at least pct percent of the samples are <= v,
+// rounded up to the bucket boundary
+uint64_t latency_hist_percentile(const latency_hist_t *hist, double pct);
+// lower bound of a bucket
+uint64_t latency_hist_bucket_value(int bucket);
+// monotonic clock in nanoseconds
+uint64_t latency_hist_now(void);
+
+static inline
+int latency_hist_bucket(uint64_t value)
+{
+	if (value < (1u << LATENCY_HIST_SUB_BITS))
+		return (int)value;
+
+	#ifdef _MSC_VER
+	unsigned long msb;
+	_BitScanReverse64(&msb, value);
+	#else
+	int msb = 63 - __builtin_clzll(value);
+	#endif
+	if ((int)msb >= LATENCY_HIST_MAX_BITS)
+		return LATENCY_HIST_BUCKETS - 1;
+
+	int shift = (int)msb - LATENCY_HIST_SUB_BITS;
+	return ((shift + 1) << LATENCY_HIST_SUB_BITS)
+		+ (int)((value >> shift) & ((1u << LATENCY_HIST_SUB_BITS) - 1));
+}
+
+static inline
+void latency_hist_record(latency_hist_t *hist, uint64_t value)
+{
+	hist->buckets[latency_hist_bucket(value)]++;
+	if (hist->count==0 || value < hist->min)
+		hist->min = value;
+	if (value > hist->max)
+		hist->max = value;
+	hist->count++;
+	hist->sum += value;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
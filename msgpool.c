@@ -0,0 +1,92 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <zmq.h>
+
+#include "msgpool.h"
+
+union msgpool_node_t
+{
+	zmq_msg_t msg;		// must be first, callers only see this
+	msgpool_node_t *next;
+};
+
+struct msgpool_chunk_t
+{
+	msgpool_chunk_t *next;
+	msgpool_node_t nodes[1];
+};
+
+static
+void s_add_chunk(msgpool_t *pool, int count)
+{
+	msgpool_chunk_t *chunk = (msgpool_chunk_t *)malloc(
+			sizeof(msgpool_chunk_t) + (count - 1) * sizeof(msgpool_node_t));
+	if (!chunk) {
+		fprintf(stderr, "msgpool: memory allocation failed, aborting\n");
+		abort();
+	}
+
+	chunk->next = pool->chunks;
+	pool->chunks = chunk;
+
+	int idx;
+	for (idx=0; idx < count; idx++) {
+		chunk->nodes[idx].next = pool->free;
+		pool->free = &chunk->nodes[idx];
+	}
+}
+
+void
+msgpool_init(msgpool_t *pool, int chunk_size)
+{
+	pool->free = NULL;
+	pool->chunks = NULL;
+	pool->chunk_size = chunk_size > 0 ? chunk_size : 16;
+}
+
+void
+msgpool_destroy(msgpool_t *pool)
+{
+	while (pool->chunks) {
+		msgpool_chunk_t *chunk = pool->chunks;
+		pool->chunks = chunk->next;
+		free(chunk);
+	}
+	pool->free = NULL;
+}
+
+void
+msgpool_reserve(msgpool_t *pool, int count)
+{
+	msgpool_node_t *node;
+	for (node = pool->free; node && count > 0; node = node->next)
+		count--;
+
+	if (count > 0)
+		s_add_chunk(pool, count > pool->chunk_size ? count : pool->chunk_size);
+}
+
+zmq_msg_t *
+msgpool_get(msgpool_t *pool)
+{
+	if (!pool->free)
+		s_add_chunk(pool, pool->chunk_size);
+
+	msgpool_node_t *node = pool->free;
+	pool->free = node->next;
+
+	zmq_msg_init(&node->msg);
+	return &node->msg;
+}
+
+void
+msgpool_put(msgpool_t *pool, zmq_msg_t *msg)
+{
+	msgpool_node_t *node = (msgpool_node_t *)msg;
+
+	zmq_msg_close(msg);
+	node->next = pool->free;
+	pool->free = node;
+}
+
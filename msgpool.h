@@ -0,0 +1,45 @@
+#ifndef MSGPOOL_H_
+#define MSGPOOL_H_
+
+#include <zmq.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// free list of zmq_msg_t, allocated in chunks that never move
+
+union msgpool_node_t;
+typedef union msgpool_node_t msgpool_node_t;
+
+struct msgpool_chunk_t;
+typedef struct msgpool_chunk_t msgpool_chunk_t;
+
+struct msgpool_t;
+typedef struct msgpool_t msgpool_t;
+
+struct msgpool_t
+{
+	// private
+	msgpool_node_t *free;
+	msgpool_chunk_t *chunks;
+	int chunk_size;
+};
+
+void msgpool_init(msgpool_t *pool, int chunk_size);
+// all the messages obtained from the pool become invalid
+void msgpool_destroy(msgpool_t *pool);
+// makes at least count messages available without further allocation
+void msgpool_reserve(msgpool_t *pool, int count);
+
+// returns an initialized, empty message
+zmq_msg_t *msgpool_get(msgpool_t *pool);
+// closes the message and gives it back to the pool
+void msgpool_put(msgpool_t *pool, zmq_msg_t *msg);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
@@ -1,18 +1,94 @@
 #include <assert.h>
+#include <errno.h>
 #include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
 
 #include <uv.h>
 #include <zmq.h>
 
 #include "uv_zsock.h"
 
+struct uv_zsock_hub_s
+{
+	uv_loop_t *loop;
+	int refcount;		// uv_zsock_t initialized and not yet closed
+	int closing;		// handles closed, waiting for the callbacks
+
+	uv_prepare_t w_prepare;
+	uv_check_t w_check;
+	uv_idle_t w_idle;
+
+	// all started watchers, compact
+	uv_zsock_t **socks;
+	int nsocks;
+	int maxsocks;
+
+	// watchers to be examined by the next check pass.
+	// entries of watchers stopped meanwhile are NULL.
+	uv_zsock_t **ready;
+	int nready;
+	int maxready;
+
+	// the handle whose callback is running.
+	// reset if the callback stops it.
+	uv_zsock_t *current;
+
+	// scratch space for uv_zsock_recv_start(), shared by the handles
+	zmq_msg_t *msgs;
+	int maxmsgs;
+
+	uv_zsock_hub_t *next;
+};
+
+// loops may run on several threads, each with its own hub
+static uv_zsock_hub_t *s_hubs = NULL;
+#ifdef _WIN32
+static SRWLOCK s_hubs_lock = SRWLOCK_INIT;
+#else
+static pthread_mutex_t s_hubs_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
 static
-void s_idle_cb(uv_idle_t *handle)
+void s_hubs_acquire(void)
 {
+	#ifdef _WIN32
+	AcquireSRWLockExclusive(&s_hubs_lock);
+	#else
+	pthread_mutex_lock(&s_hubs_lock);
+	#endif
 }
 
 static
-void s_poll_cb(uv_poll_t *handle, int status, int events)
+void s_hubs_release(void)
+{
+	#ifdef _WIN32
+	ReleaseSRWLockExclusive(&s_hubs_lock);
+	#else
+	pthread_mutex_unlock(&s_hubs_lock);
+	#endif
+}
+
+static
+void *s_realloc(void *ptr, size_t size)
+{
+	ptr = realloc(ptr, size);
+	if (!ptr) {
+		fprintf(stderr, "uv_zsock: memory allocation failed, aborting\n");
+		abort();
+	}
+	return ptr;
+}
+
+static
+void s_idle_cb(uv_idle_t *handle)
 {
 }
 
@@ -25,10 +101,8 @@ int s_get_revents(void *zsock, int events)
 	size_t optlen = sizeof(zmq_events);
 	int rc = zmq_getsockopt(zsock, ZMQ_EVENTS, &zmq_events, &optlen);
 
-	if (rc==-1) {
-		// on error, make callback get called
-		return events;
-	}
+	if (rc==-1)
+		return UV_ZSOCK_ERROR;
 
 	if (zmq_events & ZMQ_POLLOUT)
 		revents |= events & UV_WRITABLE;
@@ -38,34 +112,343 @@ int s_get_revents(void *zsock, int events)
 	return revents;
 }
 
+#define UV_ZSOCK_BACKOFF_MIN 1
+#define UV_ZSOCK_BACKOFF_MAX 1000
+
+// the socket is not coming back
+static
+int s_gone(void)
+{
+	return errno==ETERM || errno==ENOTSOCK;
+}
+
+static
+void s_queue_ready(uv_zsock_hub_t *hub, uv_zsock_t *wz)
+{
+	if (wz->ready_index >= 0 || wz->parked)
+		return;
+
+	if (hub->nready==hub->maxready) {
+		hub->maxready = hub->maxready ? hub->maxready * 2 : 16;
+		hub->ready = (uv_zsock_t **)s_realloc(hub->ready,
+				hub->maxready * sizeof(*hub->ready));
+	}
+
+	wz->ready_index = hub->nready;
+	hub->ready[hub->nready++] = wz;
+}
+
+static
+void s_poll_cb(uv_poll_t *handle, int status, int events)
+{
+	uv_zsock_t *wz = (uv_zsock_t *)handle->data;
+
+	// ZMQ_FD signalled, state of the socket may have changed
+	s_queue_ready(wz->hub, wz);
+
+	#ifdef ZSOCK_LATENCY_HIST
+	if (!wz->t_signalled)
+		wz->t_signalled = uv_hrtime();
+	#endif
+}
+
 static
 void s_prepare_cb(uv_prepare_t *handle)
 {
-	uv_zsock_t *wz = (uv_zsock_t *)
-		(((char *)handle) - offsetof(uv_zsock_t, w_prepare));
+	uv_zsock_hub_t *hub = (uv_zsock_hub_t *)handle->data;
 
-	int revents = s_get_revents(wz->zsock, wz->events);
-	if (revents) {
+	// a single pass over all the sockets. this also catches sockets whose
+	// ZMQ_FD edge got consumed by a zmq_send / zmq_recv done outside of
+	// their callback.
+	int idx;
+	for (idx=0; idx < hub->nsocks; idx++) {
+		uv_zsock_t *wz = hub->socks[idx];
+		if (!wz->parked && s_get_revents(wz->zsock, wz->events))
+			s_queue_ready(hub, wz);
+	}
+
+	if (hub->nready) {
 		// idle ensures that libuv will not block
-		uv_idle_start(&wz->w_idle, s_idle_cb);
+		uv_idle_start(&hub->w_idle, s_idle_cb);
 	}
 }
 
+// returns non-zero if the budget ran out before the socket did
+static
+int s_recv(uv_zsock_hub_t *hub, uv_zsock_t *wz)
+{
+	if (hub->maxmsgs < wz->recv_max) {
+		hub->msgs = (zmq_msg_t *)s_realloc(hub->msgs,
+				wz->recv_max * sizeof(*hub->msgs));
+		hub->maxmsgs = wz->recv_max;
+	}
+
+	int exhausted = 1;
+	int count;
+	for (count=0; count < wz->recv_max; count++) {
+		zmq_msg_t *msg = &hub->msgs[count];
+		zmq_msg_init(msg);
+		if (zmq_msg_recv(msg, wz->zsock, ZMQ_DONTWAIT)==-1) {
+			zmq_msg_close(msg);
+			exhausted = 0;
+			break;
+		}
+	}
+
+	if (count > 0) {
+		wz->recv_cb(wz, hub->msgs, count);
+
+		int idx;
+		for (idx=0; idx < count; idx++)
+			zmq_msg_close(&hub->msgs[idx]);
+	}
+
+	return exhausted;
+}
+
+// the frame is received as a zmq_msg_t to learn its size, then copied
+// once into the application's buffer, as zmq_recv() would have done.
+// returns non-zero if the budget ran out before the socket did
+static
+int s_read(uv_zsock_hub_t *hub, uv_zsock_t *wz)
+{
+	uv_zsock_alloc_cbfn alloc_cb = wz->alloc_cb;
+	uv_zsock_read_cbfn read_cb = wz->read_cb;
+
+	zmq_msg_t msg;
+	zmq_msg_init(&msg);
+
+	int exhausted = 1;
+	int count;
+	for (count=0; count < UV_ZSOCK_READ_MAX; count++) {
+		if (zmq_msg_recv(&msg, wz->zsock, ZMQ_DONTWAIT)==-1) {
+			exhausted = 0;
+			break;
+		}
+
+		size_t size = zmq_msg_size(&msg);
+		int more = zmq_msg_more(&msg);
+
+		uv_buf_t buf = uv_buf_init(NULL, 0);
+		alloc_cb(wz, size, &buf);
+
+		ssize_t nread;
+		if (buf.base==NULL || buf.len < size) {
+			nread = UV_ENOBUFS;
+		} else {
+			memcpy(buf.base, zmq_msg_data(&msg), size);
+			nread = (ssize_t)size;
+		}
+		read_cb(wz, nread, &buf, more);
+
+		// read_cb may have stopped the handle, or restarted it in another
+		// mode or with other callbacks
+		if (hub->current!=wz || wz->read_cb!=read_cb || wz->alloc_cb!=alloc_cb) {
+			exhausted = 0;
+			break;
+		}
+	}
+
+	zmq_msg_close(&msg);
+	return exhausted;
+}
+
+static
+void s_retry_cb(uv_timer_t *handle)
+{
+	uv_zsock_t *wz = (uv_zsock_t *)handle->data;
+
+	if (s_get_revents(wz->zsock, wz->events) & UV_ZSOCK_ERROR) {
+		wz->errors++;
+		if (s_gone()) {
+			// cb already got UV_ZSOCK_ERROR when it was parked
+			uv_zsock_stop(wz);
+			return;
+		}
+		wz->backoff *= 2;
+		if (wz->backoff > UV_ZSOCK_BACKOFF_MAX)
+			wz->backoff = UV_ZSOCK_BACKOFF_MAX;
+		uv_timer_start(&wz->w_retry, s_retry_cb, wz->backoff, 0);
+		return;
+	}
+
+	wz->parked = 0;
+	uv_poll_start(&wz->w_poll, wz->events ? UV_READABLE : 0, s_poll_cb);
+	s_queue_ready(wz->hub, wz);
+}
+
+static
+void s_park(uv_zsock_t *wz)
+{
+	wz->parked = 1;
+	uv_poll_stop(&wz->w_poll);
+
+	wz->backoff = UV_ZSOCK_BACKOFF_MIN;
+	uv_timer_start(&wz->w_retry, s_retry_cb, wz->backoff, 0);
+}
+
 static
 void s_check_cb(uv_check_t *handle)
 {
-	uv_zsock_t *wz = (uv_zsock_t *)
-		(((char *)handle) - offsetof(uv_zsock_t, w_check));
+	uv_zsock_hub_t *hub = (uv_zsock_hub_t *)handle->data;
+
+	uv_idle_stop(&hub->w_idle);
+
+	// only the sockets that were ready in prepare or whose ZMQ_FD fired.
+	// callbacks may stop any watcher, which clears its entry.
+	int idx;
+	for (idx=0; idx < hub->nready; idx++) {
+		uv_zsock_t *wz = hub->ready[idx];
+		if (!wz)
+			continue;
+
+		hub->ready[idx] = NULL;
+		wz->ready_index = -1;
+
+		int revents = s_get_revents(wz->zsock, wz->events);
+		wz->events &= ~(revents & wz->oneshot);
+		hub->current = wz;
+
+		int gone = 0;
+		if (revents & UV_ZSOCK_ERROR) {
+			gone = s_gone();
+			wz->errors++;
+			s_park(wz);
+
+			// reported once, through whichever callback is set
+			if (wz->read_cb) {
+				uv_buf_t buf = uv_buf_init(NULL, 0);
+				wz->read_cb(wz, UV_EIO, &buf, 0);
+			}
+			if (hub->current==wz && wz->cb)
+				wz->cb(wz, revents);
+			if (gone && hub->current==wz)
+				uv_zsock_stop(wz);
+			continue;
+		}
+
+		#ifdef ZSOCK_LATENCY_HIST
+		uint64_t t_dispatch = 0;
+		if (revents) {
+			t_dispatch = uv_hrtime();
+			if (wz->t_signalled) {
+				latency_hist_record(&wz->hist_wait, t_dispatch - wz->t_signalled);
+				wz->t_signalled = 0;
+			}
+		}
+		#endif
+
+		if ((revents & UV_READABLE) && wz->recv_cb) {
+			revents &= ~UV_READABLE;
+			if (s_recv(hub, wz)) {
+				// messages are still pending, don't let libuv block
+				uv_idle_start(&hub->w_idle, s_idle_cb);
+			}
+		}
+
+		if ((revents & UV_READABLE) && wz->read_cb) {
+			revents &= ~UV_READABLE;
+			if (s_read(hub, wz))
+				uv_idle_start(&hub->w_idle, s_idle_cb);
+		}
+
+		if (revents && hub->current==wz)
+		{
+			wz->cb(wz, revents);
+		}
+
+		#ifdef ZSOCK_LATENCY_HIST
+		if (t_dispatch && hub->current==wz)
+			latency_hist_record(&wz->hist_cb, uv_hrtime() - t_dispatch);
+		#endif
+	}
+	hub->nready = 0;
+	hub->current = NULL;
+}
+
+static
+uv_zsock_hub_t *s_hub_acquire(uv_loop_t *loop)
+{
+	// the hub itself is only ever touched by its loop's thread
+	uv_zsock_hub_t *hub;
+	s_hubs_acquire();
+	for (hub = s_hubs; hub; hub = hub->next) {
+		if (hub->loop==loop && !hub->closing)
+			break;
+	}
+	s_hubs_release();
+	if (hub) {
+		hub->refcount++;
+		return hub;
+	}
+
+	hub = (uv_zsock_hub_t *)s_realloc(NULL, sizeof(*hub));
+	hub->loop = loop;
+	hub->refcount = 1;
+	hub->closing = 0;
+
+	hub->w_prepare.data = hub;
+	hub->w_check.data = hub;
+	hub->w_idle.data = hub;
 
-	uv_idle_stop(&wz->w_idle);
+	uv_prepare_init(loop, &hub->w_prepare);
+	uv_check_init(loop, &hub->w_check);
+	uv_idle_init(loop, &hub->w_idle);
 
-	int revents = s_get_revents(wz->zsock, wz->events);
-	if (revents)
-	{
-		wz->cb(wz, revents);
+	hub->socks = NULL;
+	hub->nsocks = 0;
+	hub->maxsocks = 0;
+	hub->ready = NULL;
+	hub->nready = 0;
+	hub->maxready = 0;
+	hub->current = NULL;
+	hub->msgs = NULL;
+	hub->maxmsgs = 0;
+
+	s_hubs_acquire();
+	hub->next = s_hubs;
+	s_hubs = hub;
+	s_hubs_release();
+
+	return hub;
+}
+
+static
+void s_hub_close_cb(uv_handle_t *handle)
+{
+	uv_zsock_hub_t *hub = (uv_zsock_hub_t *)handle->data;
+	handle->data = NULL;	// mark as closed
+
+	if (hub->w_prepare.data==NULL && hub->w_check.data==NULL &&
+			hub->w_idle.data==NULL) {
+		uv_zsock_hub_t **phub;
+		s_hubs_acquire();
+		for (phub = &s_hubs; *phub != hub; phub = &(*phub)->next)
+			;
+		*phub = hub->next;
+		s_hubs_release();
+
+		free(hub->socks);
+		free(hub->ready);
+		free(hub->msgs);
+		free(hub);
 	}
 }
 
+static
+void s_hub_release(uv_zsock_hub_t *hub)
+{
+	if (--hub->refcount > 0)
+		return;
+
+	// the last socket of the loop is gone, so that
+	// uv_loop_close() does not find our handles
+	hub->closing = 1;
+	uv_close((uv_handle_t*)&hub->w_prepare, s_hub_close_cb);
+	uv_close((uv_handle_t*)&hub->w_check, s_hub_close_cb);
+	uv_close((uv_handle_t*)&hub->w_idle, s_hub_close_cb);
+}
+
 void
 uv_zsock_init(uv_loop_t *loop, uv_zsock_t *wz, void *zsock)
 {
@@ -73,15 +456,29 @@ uv_zsock_init(uv_loop_t *loop, uv_zsock_t *wz, void *zsock)
 	wz->zsock = zsock;
 	wz->cb = NULL;
 	wz->events = 0;
+	wz->errors = 0;
+	wz->oneshot = 0;
+	wz->parked = 0;
+	wz->backoff = 0;
+	wz->recv_cb = NULL;
+	wz->recv_max = 0;
+	wz->alloc_cb = NULL;
+	wz->read_cb = NULL;
+	msgpool_init(&wz->pool, 0);
+
+	wz->hub = s_hub_acquire(loop);
+	wz->index = -1;
+	wz->ready_index = -1;
 
-	wz->w_prepare.data = wz;
-	wz->w_check.data = wz;
-	wz->w_idle.data = wz;
 	wz->w_poll.data = wz;
+	uv_timer_init(loop, &wz->w_retry);
+	wz->w_retry.data = wz;
 
-	uv_prepare_init(loop, &wz->w_prepare);
-	uv_check_init(loop, &wz->w_check);
-	uv_idle_init(loop, &wz->w_idle);
+	#ifdef ZSOCK_LATENCY_HIST
+	wz->t_signalled = 0;
+	latency_hist_reset(&wz->hist_wait);
+	latency_hist_reset(&wz->hist_cb);
+	#endif
 
 	uv_os_sock_t sockfd;
 	size_t optlen = sizeof(sockfd);
@@ -91,24 +488,95 @@ uv_zsock_init(uv_loop_t *loop, uv_zsock_t *wz, void *zsock)
 	uv_poll_init_socket(loop, &wz->w_poll, sockfd);
 }
 
-void
-uv_zsock_start(uv_zsock_t *wz, uv_zsock_cbfn cb, int events)
+static
+void s_start(uv_zsock_t *wz, uv_zsock_cbfn cb, int events)
 {
+	uv_zsock_hub_t *hub = wz->hub;
+
 	wz->cb = cb;
 	wz->events = events;
 
-	uv_prepare_start(&wz->w_prepare, s_prepare_cb);
-	uv_check_start(&wz->w_check, s_check_cb);
-	uv_poll_start(&wz->w_poll, wz->events ? UV_READABLE : 0, s_poll_cb);
+	if (wz->index < 0) {
+		if (hub->nsocks==hub->maxsocks) {
+			hub->maxsocks = hub->maxsocks ? hub->maxsocks * 2 : 16;
+			hub->socks = (uv_zsock_t **)s_realloc(hub->socks,
+					hub->maxsocks * sizeof(*hub->socks));
+		}
+
+		wz->index = hub->nsocks;
+		hub->socks[hub->nsocks++] = wz;
+
+		if (hub->nsocks==1) {
+			uv_prepare_start(&hub->w_prepare, s_prepare_cb);
+			uv_check_start(&hub->w_check, s_check_cb);
+		}
+	}
+
+	if (!wz->parked)
+		uv_poll_start(&wz->w_poll, wz->events ? UV_READABLE : 0, s_poll_cb);
+}
+
+void
+uv_zsock_start(uv_zsock_t *wz, uv_zsock_cbfn cb, int events)
+{
+	wz->recv_cb = NULL;
+	wz->read_cb = NULL;
+	s_start(wz, cb, events);
+}
+
+void
+uv_zsock_recv_start(uv_zsock_t *wz, uv_zsock_recv_cbfn recv_cb, int max_msgs)
+{
+	assert(max_msgs > 0);
+
+	wz->recv_cb = recv_cb;
+	wz->recv_max = max_msgs;
+	wz->read_cb = NULL;
+	s_start(wz, NULL, UV_READABLE);
+}
+
+void
+uv_zsock_read_start(uv_zsock_t *wz, uv_zsock_alloc_cbfn alloc_cb,
+		uv_zsock_read_cbfn read_cb)
+{
+	assert(alloc_cb && read_cb);
+
+	wz->recv_cb = NULL;
+	wz->alloc_cb = alloc_cb;
+	wz->read_cb = read_cb;
+	s_start(wz, NULL, UV_READABLE);
 }
 
 void
 uv_zsock_stop(uv_zsock_t *wz)
 {
-	uv_prepare_stop(&wz->w_prepare);
-	uv_check_stop(&wz->w_check);
-	uv_idle_stop(&wz->w_idle);
+	uv_zsock_hub_t *hub = wz->hub;
+
 	uv_poll_stop(&wz->w_poll);
+	uv_timer_stop(&wz->w_retry);
+	wz->parked = 0;
+
+	if (wz->index < 0)
+		return;
+
+	if (wz->ready_index >= 0) {
+		hub->ready[wz->ready_index] = NULL;
+		wz->ready_index = -1;
+	}
+	if (hub->current==wz)
+		hub->current = NULL;
+
+	// move the last watcher into the vacated slot
+	uv_zsock_t *last = hub->socks[--hub->nsocks];
+	hub->socks[wz->index] = last;
+	last->index = wz->index;
+	wz->index = -1;
+
+	if (hub->nsocks==0) {
+		uv_prepare_stop(&hub->w_prepare);
+		uv_check_stop(&hub->w_check);
+		uv_idle_stop(&hub->w_idle);
+	}
 }
 
 static
@@ -117,18 +585,76 @@ void s_close_cb(uv_handle_t *handle)
 	uv_zsock_t *wz = (uv_zsock_t*)handle->data;
 	handle->data = NULL;	// mark as closed
 
-	if (wz->w_prepare.data==NULL && wz->w_check.data==NULL &&
-			wz->w_idle.data==NULL && wz->w_poll.data==NULL) {
-				if (wz->close_cb)	wz->close_cb(wz);
-	}
+	// done once both handles are closed
+	if (wz->w_poll.data || wz->w_retry.data)
+		return;
+
+	msgpool_destroy(&wz->pool);
+	if (wz->close_cb)	wz->close_cb(wz);
 }
 
 void
 uv_zsock_close(uv_zsock_t *wz, uv_zsock_close_cbfn cb)
 {
+	uv_zsock_stop(wz);
+	s_hub_release(wz->hub);
+	wz->hub = NULL;
+
 	wz->close_cb = cb;
-	uv_close((uv_handle_t*)&wz->w_prepare, s_close_cb);
-	uv_close((uv_handle_t*)&wz->w_check, s_close_cb);
-	uv_close((uv_handle_t*)&wz->w_idle, s_close_cb);
 	uv_close((uv_handle_t*)&wz->w_poll, s_close_cb);
+	uv_close((uv_handle_t*)&wz->w_retry, s_close_cb);
+}
+
+int
+uv_zsock_is_parked(uv_zsock_t *wz)
+{
+	return wz->parked;
+}
+
+void
+uv_zsock_set_oneshot(uv_zsock_t *wz, int events)
+{
+	wz->oneshot = events;
+}
+
+void
+uv_zsock_rearm(uv_zsock_t *wz, int events)
+{
+	// picked up by the next prepare pass
+	wz->events |= events;
+}
+
+zmq_msg_t *
+uv_zsock_msg_keep(uv_zsock_t *wz, zmq_msg_t *msg)
+{
+	zmq_msg_t *kept = msgpool_get(&wz->pool);
+	zmq_msg_move(kept, msg);
+	return kept;
+}
+
+void
+uv_zsock_msg_release(uv_zsock_t *wz, zmq_msg_t *msg)
+{
+	msgpool_put(&wz->pool, msg);
+}
+
+void
+uv_zsock_msg_reserve(uv_zsock_t *wz, int count)
+{
+	msgpool_reserve(&wz->pool, count);
+}
+
+#ifdef ZSOCK_LATENCY_HIST
+void
+uv_zsock_latency_snapshot(uv_zsock_t *wz, latency_hist_t *wait,
+		latency_hist_t *cb, int reset)
+{
+	if (wait)	*wait = wz->hist_wait;
+	if (cb)	*cb = wz->hist_cb;
+
+	if (reset) {
+		latency_hist_reset(&wz->hist_wait);
+		latency_hist_reset(&wz->hist_cb);
+	}
 }
+#endif
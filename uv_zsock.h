@@ -2,6 +2,12 @@
 #define UV_ZSOCK_H_
 
 #include <uv.h>
+#include <zmq.h>
+
+#include "msgpool.h"
+#ifdef ZSOCK_LATENCY_HIST
+#include "latency_hist.h"
+#endif
 
 #ifdef __cplusplus
 extern "C" {
@@ -10,9 +16,24 @@ extern "C" {
 struct uv_zsock_s;
 typedef struct uv_zsock_s uv_zsock_t;
 
+// one per uv_loop_t, shared by all the uv_zsock_t initialized on that loop
+struct uv_zsock_hub_s;
+typedef struct uv_zsock_hub_s uv_zsock_hub_t;
+
 typedef void (*uv_zsock_cbfn)(uv_zsock_t *handle, int revents);
 typedef void (*uv_zsock_close_cbfn)(uv_zsock_t*);
 
+// msgs are closed after the callback returns.
+// use uv_zsock_msg_keep() to keep any of them.
+typedef void (*uv_zsock_recv_cbfn)(uv_zsock_t *handle, zmq_msg_t *msgs, int count);
+
+// like uv_alloc_cb, suggested_size being the size of the pending frame
+typedef void (*uv_zsock_alloc_cbfn)(uv_zsock_t *handle, size_t suggested_size, uv_buf_t *buf);
+// like uv_read_cb, one call per frame. more is set when further frames
+// of the same multipart message follow.
+typedef void (*uv_zsock_read_cbfn)(uv_zsock_t *handle, ssize_t nread,
+		const uv_buf_t *buf, int more);
+
 struct uv_zsock_s
 {
 	void *data;		// rw
@@ -20,14 +41,30 @@ struct uv_zsock_s
 
 	void *zsock;		// read-only
 	uv_zsock_cbfn cb;	// read-only
-	int events;		// read-only
+	int events;		// read-only, armed events
+	int errors;		// read-only, failed ZMQ_EVENTS queries
 
 	// private
+	int oneshot;
+	int parked;
+	uint64_t backoff;	// ms
+	uv_timer_t w_retry;
 	uv_zsock_close_cbfn close_cb;
-	uv_prepare_t w_prepare;
-	uv_check_t w_check;
-	uv_idle_t w_idle;
+	uv_zsock_recv_cbfn recv_cb;
+	int recv_max;
+	uv_zsock_alloc_cbfn alloc_cb;
+	uv_zsock_read_cbfn read_cb;
+	msgpool_t pool;
+	uv_zsock_hub_t *hub;
+	int index;		// slot in hub->socks, -1 when stopped
+	int ready_index;	// slot in hub->ready, -1 when not queued
 	uv_poll_t w_poll;
+
+	#ifdef ZSOCK_LATENCY_HIST
+	uint64_t t_signalled;	// when ZMQ_FD fired, 0 once reported
+	latency_hist_t hist_wait;	// ZMQ_FD fired -> callback invoked
+	latency_hist_t hist_cb;	// callback duration
+	#endif
 };
 
 void uv_zsock_init(uv_loop_t *loop, uv_zsock_t *wz, void *zsock);
@@ -35,6 +72,51 @@ void uv_zsock_start(uv_zsock_t *wz, uv_zsock_cbfn cb, int events);
 void uv_zsock_stop(uv_zsock_t *wz);
 void uv_zsock_close(uv_zsock_t *wz, uv_zsock_close_cbfn cb);
 
+// when ZMQ_EVENTS cannot be read, cb gets UV_ZSOCK_ERROR once (read_cb gets
+// UV_EIO, recv_cb only counts it in errors) and the handle is parked: it is
+// left out of polling and retried with exponential backoff, then resumes
+// once the socket works. stop the handle from cb to give up on it. if the
+// context got terminated (ETERM) or libzmq reports ENOTSOCK, the handle gets
+// stopped after cb instead.
+// a handle must be stopped before its socket is closed: libzmq cannot be
+// called on a closed socket.
+#define UV_ZSOCK_ERROR 0x100
+int uv_zsock_is_parked(uv_zsock_t *wz);
+
+// events in the mask (typically UV_WRITABLE) get disarmed after being
+// reported once, until they are armed again with uv_zsock_rearm().
+// avoids waking up on every iteration for an always writable socket.
+void uv_zsock_set_oneshot(uv_zsock_t *wz, int events);
+void uv_zsock_rearm(uv_zsock_t *wz, int events);
+
+// receive the messages on behalf of the caller and hand up to max_msgs
+// of them to recv_cb per wakeup. stopped by uv_zsock_stop().
+void uv_zsock_recv_start(uv_zsock_t *wz, uv_zsock_recv_cbfn recv_cb, int max_msgs);
+
+// receive the frames into buffers obtained from alloc_cb and hand them to
+// read_cb, up to UV_ZSOCK_READ_MAX per wakeup. a frame that does not fit
+// in the buffer is dropped and reported as UV_ENOBUFS, with the buffer so
+// that it can be given back. stopped by uv_zsock_stop().
+#define UV_ZSOCK_READ_MAX 64
+void uv_zsock_read_start(uv_zsock_t *wz, uv_zsock_alloc_cbfn alloc_cb,
+		uv_zsock_read_cbfn read_cb);
+
+// takes ownership of a message handed to recv_cb without copying its
+// payload. the returned message comes from the handle's pool and must be
+// given back with uv_zsock_msg_release(), which also closes it.
+// the pool is freed when the handle is closed.
+zmq_msg_t *uv_zsock_msg_keep(uv_zsock_t *wz, zmq_msg_t *msg);
+void uv_zsock_msg_release(uv_zsock_t *wz, zmq_msg_t *msg);
+// preallocates the pool so that keeping messages does not allocate
+void uv_zsock_msg_reserve(uv_zsock_t *wz, int count);
+
+#ifdef ZSOCK_LATENCY_HIST
+// copies the histograms (either pointer may be NULL), then optionally
+// resets them. a callback that stops its own handle is not timed.
+void uv_zsock_latency_snapshot(uv_zsock_t *wz, latency_hist_t *wait,
+		latency_hist_t *cb, int reset);
+#endif
+
 #ifdef __cplusplus
 }
 #endif
@@ -31,8 +31,289 @@ void zsock_cb(uv_zsock_t *handle, int revents)
 	printf("%f\n", (ts_recv - ts_send)*1e-9);
 }
 
-int main()
+// self checks, each on a fresh loop with its own PUSH/PULL pairs
+
+#define NPAIRS 4
+
+typedef struct {
+	void *zctx;
+	uv_loop_t loop;
+	void *pull[NPAIRS];
+	void *push[NPAIRS];
+	int calls;
+	int got;		// messages or frames
+	int nobufs;
+	zmq_msg_t *kept;
+} check_t;
+
+static void
+s_check_setup(check_t *check)
+{
+	static int endpoint = 0;
+
+	check->zctx = zmq_ctx_new();
+	uv_loop_init(&check->loop);
+	check->calls = 0;
+	check->got = 0;
+	check->nobufs = 0;
+	check->kept = NULL;
+
+	int idx;
+	for (idx=0; idx < NPAIRS; idx++) {
+		char addr[32];
+		snprintf(addr, sizeof(addr), "inproc://check%d", endpoint++);
+		check->pull[idx] = zmq_socket(check->zctx, ZMQ_PULL);
+		int rc = zmq_bind(check->pull[idx], addr);
+		assert(rc!=-1);
+		check->push[idx] = zmq_socket(check->zctx, ZMQ_PUSH);
+		rc = zmq_connect(check->push[idx], addr);
+		assert(rc!=-1);
+	}
+}
+
+// the handles must have been closed
+static void
+s_check_teardown(check_t *check)
+{
+	uv_run(&check->loop, UV_RUN_DEFAULT);
+	int rc = uv_loop_close(&check->loop);
+	assert(rc==0);
+
+	int idx;
+	for (idx=0; idx < NPAIRS; idx++) {
+		zmq_close(check->pull[idx]);
+		zmq_close(check->push[idx]);
+	}
+	zmq_ctx_destroy(check->zctx);
+}
+
+static void
+s_run_a_few(check_t *check)
+{
+	int iter;
+	for (iter=0; iter < 4; iter++)
+		uv_run(&check->loop, UV_RUN_NOWAIT);
+}
+
+// recv mode: up to max_msgs per wakeup, a kept message outlives it
+
+static void
+s_recv_cb(uv_zsock_t *handle, zmq_msg_t *msgs, int count)
+{
+	check_t *check = (check_t *)handle->data;
+
+	assert(count <= 16);
+	int idx;
+	for (idx=0; idx < count; idx++)
+		assert(*(char *)zmq_msg_data(&msgs[idx])==(char)(check->got + idx));
+
+	if (!check->kept)
+		check->kept = uv_zsock_msg_keep(handle, &msgs[0]);
+	check->got += count;
+	check->calls++;
+}
+
+static void
+s_check_recv(void)
+{
+	check_t check;
+	s_check_setup(&check);
+
+	char idx;
+	for (idx=0; idx < 100; idx++)
+		zmq_send(check.push[0], &idx, 1, 0);
+
+	uv_zsock_t wz;
+	uv_zsock_init(&check.loop, &wz, check.pull[0]);
+	wz.data = &check;
+	uv_zsock_recv_start(&wz, s_recv_cb, 16);
+
+	while (check.got < 100)
+		uv_run(&check.loop, UV_RUN_NOWAIT);
+	assert(check.calls >= 7);
+
+	assert(zmq_msg_size(check.kept)==1 && *(char *)zmq_msg_data(check.kept)==0);
+	uv_zsock_msg_release(&wz, check.kept);
+
+	uv_zsock_close(&wz, NULL);
+	s_check_teardown(&check);
+}
+
+// read mode: one call per frame into the application's buffer, a frame
+// too large for it being reported as UV_ENOBUFS
+
+static void
+s_alloc_cb(uv_zsock_t *handle, size_t suggested_size, uv_buf_t *buf)
+{
+	static char storage[8];
+	*buf = uv_buf_init(storage, sizeof(storage));
+}
+
+static void
+s_read_cb(uv_zsock_t *handle, ssize_t nread, const uv_buf_t *buf, int more)
 {
+	check_t *check = (check_t *)handle->data;
+
+	if (nread==UV_ENOBUFS) {
+		check->nobufs++;
+		return;
+	}
+	assert(nread==check->got % 3 + 1);
+	assert(!!more==(check->got % 3 < 2));
+	check->got++;
+}
+
+static void
+s_check_read(void)
+{
+	check_t check;
+	s_check_setup(&check);
+
+	int msg;
+	for (msg=0; msg < 50; msg++) {
+		zmq_send(check.push[0], "a", 1, ZMQ_SNDMORE);
+		zmq_send(check.push[0], "bb", 2, ZMQ_SNDMORE);
+		zmq_send(check.push[0], "ccc", 3, 0);
+	}
+	zmq_send(check.push[0], "too large", 9, 0);
+
+	uv_zsock_t wz;
+	uv_zsock_init(&check.loop, &wz, check.pull[0]);
+	wz.data = &check;
+	uv_zsock_read_start(&wz, s_alloc_cb, s_read_cb);
+
+	while (check.got + check.nobufs < 151)
+		uv_run(&check.loop, UV_RUN_NOWAIT);
+	assert(check.got==150 && check.nobufs==1);
+
+	uv_zsock_close(&wz, NULL);
+	s_check_teardown(&check);
+}
+
+// a read_cb switching the handle to readiness callbacks ends the reads
+
+static void
+s_switched_cb(uv_zsock_t *handle, int revents)
+{
+	check_t *check = (check_t *)handle->data;
+	char buf[8];
+	while (zmq_recv(handle->zsock, buf, sizeof(buf), ZMQ_DONTWAIT) >= 0)
+		check->calls++;
+}
+
+static void
+s_switch_cb(uv_zsock_t *handle, ssize_t nread, const uv_buf_t *buf, int more)
+{
+	check_t *check = (check_t *)handle->data;
+	check->got++;
+	uv_zsock_start(handle, s_switched_cb, UV_READABLE);
+}
+
+static void
+s_check_read_switch(void)
+{
+	check_t check;
+	s_check_setup(&check);
+
+	int msg;
+	for (msg=0; msg < 10; msg++)
+		zmq_send(check.push[0], "x", 1, 0);
+
+	uv_zsock_t wz;
+	uv_zsock_init(&check.loop, &wz, check.pull[0]);
+	wz.data = &check;
+	uv_zsock_read_start(&wz, s_alloc_cb, s_switch_cb);
+
+	s_run_a_few(&check);
+	assert(check.got==1 && check.calls==9);
+
+	uv_zsock_close(&wz, NULL);
+	s_check_teardown(&check);
+}
+
+// an always writable socket is reported once until rearmed
+
+static void
+s_count_cb(uv_zsock_t *handle, int revents)
+{
+	check_t *check = (check_t *)handle->data;
+	check->calls++;
+}
+
+static void
+s_check_oneshot(void)
+{
+	check_t check;
+	s_check_setup(&check);
+
+	uv_zsock_t wz;
+	uv_zsock_init(&check.loop, &wz, check.push[0]);
+	wz.data = &check;
+	uv_zsock_set_oneshot(&wz, UV_WRITABLE);
+	uv_zsock_start(&wz, s_count_cb, UV_WRITABLE);
+
+	s_run_a_few(&check);
+	assert(check.calls==1 && !(wz.events & UV_WRITABLE));
+
+	uv_zsock_rearm(&wz, UV_WRITABLE);
+	s_run_a_few(&check);
+	assert(check.calls==2);
+
+	uv_zsock_close(&wz, NULL);
+	s_check_teardown(&check);
+}
+
+// a terminated context is reported once, then the handle is stopped
+
+static void
+s_error_cb(uv_zsock_t *handle, int revents)
+{
+	check_t *check = (check_t *)handle->data;
+	assert(revents & UV_ZSOCK_ERROR);
+	check->calls++;
+}
+
+static void
+s_check_terminated(void)
+{
+	check_t check;
+	s_check_setup(&check);
+
+	uv_zsock_t wz;
+	uv_zsock_init(&check.loop, &wz, check.pull[0]);
+	wz.data = &check;
+	uv_zsock_start(&wz, s_error_cb, UV_READABLE);
+
+	s_run_a_few(&check);
+	assert(check.calls==0);
+
+	zmq_ctx_shutdown(check.zctx);
+	s_run_a_few(&check);
+	assert(check.calls==1 && wz.errors==1);
+	assert(wz.index < 0 && !uv_zsock_is_parked(&wz));
+
+	uv_zsock_close(&wz, NULL);
+	s_check_teardown(&check);
+}
+
+static void
+s_checks(void)
+{
+	s_check_recv();
+	s_check_read();
+	s_check_read_switch();
+	s_check_oneshot();
+	s_check_terminated();
+	printf("checks passed\n");
+}
+
+// with -c, only runs the self checks
+int main(int argc, char **argv)
+{
+	s_checks();
+	if (argc > 1 && !strcmp(argv[1], "-c"))
+		return 0;
+
 	uv_loop_t uvloop;
 	uv_loop_init(&uvloop);
 
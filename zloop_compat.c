@@ -1,20 +1,125 @@
 #include <czmq.h>
+#ifndef _WIN32
+#include <errno.h>
+#include <signal.h>
+#include <sched.h>
+#include <pthread.h>
+#include <fcntl.h>
+#endif
 #include "ev_zsock.h"
-#include "utlist.h"
+#include "zloop_compat.h"
 
 typedef struct _s_poller_t s_poller_t;
 typedef struct _s_timer_t s_timer_t;
+typedef struct _s_ticket_t s_ticket_t;
+typedef struct _s_post_t s_post_t;
+
+struct _s_post_t {
+	s_post_t *next;
+	zloop_post_fn *fn;
+	void *arg;
+};
+
+// tasks handled per wakeup, the rest waits for the next iteration
+#define POST_BATCH_MAX 256
+// tasks kept for reuse once run, a power of 2
+#define POST_CACHE_SIZE 256
+
+// a slot of the cache, Vyukov's bounded queue: the loop thread puts the
+// tasks it ran, posting threads take them. seq tells whose turn it is.
+typedef struct {
+	size_t seq;
+	s_post_t *post;
+} s_post_cell_t;
+
+// pollers and timers are carved out of chunks that never move,
+// free items are linked through their first word
+typedef union _s_slab_chunk_t s_slab_chunk_t;
+union _s_slab_chunk_t {
+	s_slab_chunk_t *next;
+	double align;		// items follow the header
+};
+
+typedef struct {
+	size_t item_size;
+	size_t chunk_items;	// size of the next chunk
+	size_t nfree;
+	void *free;
+	s_slab_chunk_t *chunks;
+} s_slab_t;
+
+#define SLAB_CHUNK_MIN 16
+#define SLAB_CHUNK_MAX 1024
+
+// pollers are hashed twice: readers by their zsock_t,
+// and all of them by their socket handle or fd
+enum { INDEX_BY_SOCK, INDEX_BY_HANDLE, INDEX_COUNT };
+
+typedef struct {
+	s_poller_t **buckets;
+	size_t nbuckets;	// power of 2
+	size_t count;
+} s_index_t;
+
+// a timer id is the timer's slot in zloop->timer_slots plus the slot's
+// generation, bumped whenever the slot is freed, so that a stale id does
+// not cancel the next timer to use the slot. freed slots are reused in
+// FIFO order, and a slot whose generation would wrap is retired rather
+// than reused, so no id is ever handed out twice by a loop. a loop runs
+// out of ids after about 2^31 timers.
+#define TIMER_SLOT_BITS 18
+#define TIMER_SLOT_MAX (1 << TIMER_SLOT_BITS)
+#define TIMER_GEN_MAX ((1 << (31 - TIMER_SLOT_BITS)) - 1)
+
+// running loops that get woken up by SIGINT/SIGTERM.
+// beyond that, loops only see the flags once something else wakes them up.
+#define SIGNAL_LOOPS_MAX 256
 
 struct _zloop_t {
 	struct ev_loop *evloop;
-	ev_prepare w_prepare_interrupted;
-
-	s_poller_t *pollers;
-	s_timer_t *timers;
-	s_timer_t *timers_reuse;
-	int last_timer_id;
+	#ifndef _WIN32
+	ev_async w_interrupted;		// sent from the signal handler
+	int signal_slot;		// in s_signal_loops, -1 when not registered
+	#endif
+	ev_prepare w_prepare_interrupted;	// checks the flags on each wakeup
+	bool nonstop;
+	bool ignore_interrupts;
+
+	s_slab_t poller_slab;
+	s_slab_t timer_slab;
+	s_index_t index[INDEX_COUNT];
+	ev_tstamp timer_slack;		// for new timers, seconds
+	s_timer_t **timer_slots;
+	int ntimer_slots;
+	int maxtimer_slots;
+	int free_slot_head;	// -1 when empty
+	int free_slot_tail;
+
+	// tickets all share ticket_delay, so appending keeps the list sorted
+	// by deadline. a single timer is armed for the head, lazily: it is
+	// only moved once it fires, not on each reset or delete.
+	ev_timer w_tickets;
+	s_slab_t ticket_slab;
+	s_ticket_t *tickets_head;
+	s_ticket_t *tickets_tail;
+	ev_tstamp ticket_delay;
+	s_ticket_t *firing_ticket;
+
+	// tasks posted from any thread, in Vyukov's intrusive MPSC queue:
+	// producers only swap post_head, the loop thread owns post_tail.
+	// ev_async_send() only writes to the wakeup fd when the watcher is
+	// not pending already, so a burst of posts costs a single wakeup.
+	ev_async w_posts;
+	s_post_t *post_head;
+	s_post_t *post_tail;
+	s_post_t post_stub;
+	s_post_cell_t post_cache[POST_CACHE_SIZE];
+	size_t post_cache_put;	// loop thread only
+	size_t post_cache_take;
 
 	bool canceled;
+	size_t errors;			// errors reported to the pollers
+	s_poller_t *current_poller;	// whose handler is running, reset if it gets ended
 
 	bool inside_cb_timer;
 	int inside_cb_timer_id;
@@ -32,11 +137,21 @@ struct _s_poller_t {
 	union {
 		zloop_fn *handler_poller;
 		zloop_reader_fn *handler_reader;
+		zloop_multipart_fn *handler_multipart;
 	};
 	void *arg;
-
-	s_poller_t *prev;
-	s_poller_t *next;
+	bool multipart;
+	bool tolerant;
+	size_t errors;
+
+	// a tolerant fd poller that failed, retried like a parked ev_zsock_t
+	ev_timer w_retry;
+	ev_tstamp backoff;
+
+	struct {
+		s_poller_t *prev;
+		s_poller_t *next;
+	} hlink[INDEX_COUNT];
 };
 
 struct _s_timer_t {
@@ -47,23 +162,614 @@ struct _s_timer_t {
 	size_t times;
 	void *arg;
 
-	s_timer_t *prev;
-	s_timer_t *next;
+	// with slack, the timer is armed one shot for due rounded up to the
+	// slack grid, and re-armed by s_timer_shim
+	ev_tstamp interval;
+	ev_tstamp slack;
+	ev_tstamp due;
+
+	bool active;
+	int generation;		// 1..TIMER_GEN_MAX, never 0 so ids stay > 0
+	int next_free;		// next slot in the free list
+};
+
+struct _s_ticket_t {
+	ev_tstamp when;
+	zloop_timer_fn *handler;
+	void *arg;
+
+	s_ticket_t *prev;
+	s_ticket_t *next;
 };
 
+static void
+s_slab_init(s_slab_t *slab, size_t item_size)
+{
+	size_t align = sizeof(s_slab_chunk_t);
+	slab->item_size = (item_size + align - 1) / align * align;
+	slab->chunk_items = SLAB_CHUNK_MIN;
+	slab->nfree = 0;
+	slab->free = NULL;
+	slab->chunks = NULL;
+}
+
+static void
+s_slab_destroy(s_slab_t *slab)
+{
+	while (slab->chunks) {
+		s_slab_chunk_t *chunk = slab->chunks;
+		slab->chunks = chunk->next;
+		free(chunk);
+	}
+	slab->nfree = 0;
+	slab->free = NULL;
+}
+
+static int
+s_slab_grow(s_slab_t *slab, size_t count)
+{
+	s_slab_chunk_t *chunk = (s_slab_chunk_t *)malloc(
+			sizeof(s_slab_chunk_t) + count * slab->item_size);
+	if (!chunk)
+		return -1;
+
+	chunk->next = slab->chunks;
+	slab->chunks = chunk;
+
+	// link them backwards so that they get handed out in address order
+	char *items = (char *)(chunk + 1);
+	size_t idx;
+	for (idx=count; idx > 0; idx--) {
+		void *item = items + (idx - 1) * slab->item_size;
+		*(void **)item = slab->free;
+		slab->free = item;
+	}
+	slab->nfree += count;
+	return 0;
+}
+
+static int
+s_slab_reserve(s_slab_t *slab, size_t count)
+{
+	if (slab->nfree >= count)
+		return 0;
+	return s_slab_grow(slab, count - slab->nfree);
+}
+
+static void *
+s_slab_get(s_slab_t *slab)
+{
+	if (!slab->free) {
+		if (s_slab_grow(slab, slab->chunk_items)==-1)
+			return NULL;
+		if (slab->chunk_items < SLAB_CHUNK_MAX)
+			slab->chunk_items *= 2;
+	}
+
+	void *item = slab->free;
+	slab->free = *(void **)item;
+	slab->nfree--;
+	return item;
+}
+
+static void
+s_slab_put(s_slab_t *slab, void *item)
+{
+	*(void **)item = slab->free;
+	slab->free = item;
+	slab->nfree++;
+}
+
+static uintptr_t
+s_index_key(s_poller_t *poller, int which)
+{
+	if (which==INDEX_BY_SOCK)
+		return (uintptr_t)poller->sock;
+	if (poller->item.socket)
+		return (uintptr_t)poller->item.socket;
+	return (uintptr_t)poller->item.fd;
+}
+
+static size_t
+s_index_bucket(s_index_t *index, uintptr_t key)
+{
+	// fibonacci hashing, pointers have their low bits clear
+	uint64_t hash = (uint64_t)key * 0x9E3779B97F4A7C15ull;
+	return (size_t)(hash >> 32) & (index->nbuckets - 1);
+}
+
+static void
+s_index_link(s_index_t *index, int which, s_poller_t *poller)
+{
+	size_t bucket = s_index_bucket(index, s_index_key(poller, which));
+	s_poller_t *head = index->buckets[bucket];
+
+	poller->hlink[which].prev = NULL;
+	poller->hlink[which].next = head;
+	if (head)
+		head->hlink[which].prev = poller;
+	index->buckets[bucket] = poller;
+}
+
+static void
+s_index_grow(s_index_t *index, int which)
+{
+	size_t nbuckets = index->nbuckets ? index->nbuckets * 2 : 64;
+	s_poller_t **buckets = (s_poller_t **)calloc(nbuckets, sizeof(*buckets));
+	if (!buckets)
+		return;		// keep going with longer chains
+
+	s_poller_t **old_buckets = index->buckets;
+	size_t old_nbuckets = index->nbuckets;
+	index->buckets = buckets;
+	index->nbuckets = nbuckets;
+
+	size_t bucket;
+	for (bucket=0; bucket < old_nbuckets; bucket++) {
+		s_poller_t *poller = old_buckets[bucket];
+		while (poller) {
+			s_poller_t *next = poller->hlink[which].next;
+			s_index_link(index, which, poller);
+			poller = next;
+		}
+	}
+	free(old_buckets);
+}
+
 static int
-s_next_timer_id(zloop_t *self)
+s_index_insert(s_index_t *index, int which, s_poller_t *poller)
 {
-	return ++self->last_timer_id;
+	if (index->count >= index->nbuckets)
+		s_index_grow(index, which);
+	if (!index->buckets)
+		return -1;
+
+	s_index_link(index, which, poller);
+	index->count++;
+	return 0;
+}
+
+static void
+s_index_remove(s_index_t *index, int which, s_poller_t *poller)
+{
+	s_poller_t *prev = poller->hlink[which].prev;
+	s_poller_t *next = poller->hlink[which].next;
+
+	if (prev)
+		prev->hlink[which].next = next;
+	else
+		index->buckets[s_index_bucket(index, s_index_key(poller, which))] = next;
+	if (next)
+		next->hlink[which].prev = prev;
+
+	index->count--;
+}
+
+// returns the timer behind timer_id, NULL if it is stale or bogus
+static s_timer_t *
+s_timer_lookup(zloop_t *self, int timer_id)
+{
+	if (timer_id <= 0)
+		return NULL;
+
+	int slot = timer_id & (TIMER_SLOT_MAX - 1);
+	if (slot >= self->ntimer_slots)
+		return NULL;
+
+	s_timer_t *timer = self->timer_slots[slot];
+	if (!timer || !timer->active || timer->timer_id!=timer_id)
+		return NULL;
+	return timer;
+}
+
+static int
+s_timer_slots_grow(zloop_t *self, int maxslots)
+{
+	if (maxslots > TIMER_SLOT_MAX)
+		maxslots = TIMER_SLOT_MAX;
+	if (maxslots <= self->maxtimer_slots)
+		return 0;
+
+	s_timer_t **slots = (s_timer_t **)realloc(self->timer_slots,
+			maxslots * sizeof(*slots));
+	if (!slots)
+		return -1;
+	self->timer_slots = slots;
+	self->maxtimer_slots = maxslots;
+	return 0;
+}
+
+static s_timer_t *
+s_timer_alloc(zloop_t *self)
+{
+	int slot = self->free_slot_head;
+	if (slot >= 0) {
+		s_timer_t *timer = self->timer_slots[slot];
+		self->free_slot_head = timer->next_free;
+		if (self->free_slot_head < 0)
+			self->free_slot_tail = -1;
+		return timer;
+	}
+
+	if (self->ntimer_slots==TIMER_SLOT_MAX)
+		return NULL;
+
+	if (self->ntimer_slots==self->maxtimer_slots
+			&& s_timer_slots_grow(self, self->maxtimer_slots ? self->maxtimer_slots * 2 : 64)==-1)
+		return NULL;
+
+	s_timer_t *timer = (s_timer_t *)s_slab_get(&self->timer_slab);
+	if (!timer)
+		return NULL;
+
+	slot = self->ntimer_slots++;
+	self->timer_slots[slot] = timer;
+	timer->active = false;
+	timer->generation = 1;
+	timer->timer_id = (timer->generation << TIMER_SLOT_BITS) | slot;
+	return timer;
+}
+
+static void
+s_timer_free(zloop_t *self, s_timer_t *timer)
+{
+	ev_timer_stop(self->evloop, &timer->w_timer);
+	timer->active = false;
+
+	int slot = timer->timer_id & (TIMER_SLOT_MAX - 1);
+	if (timer->generation==TIMER_GEN_MAX) {
+		// retired, the timer goes back to the slab
+		self->timer_slots[slot] = NULL;
+		s_slab_put(&self->timer_slab, timer);
+		return;
+	}
+	timer->generation++;
+	timer->timer_id = (timer->generation << TIMER_SLOT_BITS) | slot;
+
+	timer->next_free = -1;
+	if (self->free_slot_tail >= 0)
+		self->timer_slots[self->free_slot_tail]->next_free = slot;
+	else
+		self->free_slot_head = slot;
+	self->free_slot_tail = slot;
+}
+
+static bool
+s_interrupted(zloop_t *self)
+{
+	if (self->nonstop || self->ignore_interrupts)
+		return false;
+	return zsys_interrupted || zctx_interrupted;
 }
 
 static void
 s_prepare_interrupted_cb(struct ev_loop *evloop, ev_prepare *w, int revents)
 {
-	if (zctx_interrupted) {
+	zloop_t *zloop = (zloop_t *)w->data;
+	if (s_interrupted(zloop)) {
+		ev_break(evloop, EVBREAK_ONE);
+	}
+}
+
+#ifndef _WIN32
+// one process-wide handler, chained in front of CZMQ's, wakes up every
+// running loop through its ev_async. it leaves the flags to the handler
+// it chains to: whether a signal stops the loops stays up to CZMQ, or to
+// whoever replaced its handler.
+
+static pthread_mutex_t s_signal_mutex = PTHREAD_MUTEX_INITIALIZER;
+static zloop_t *s_signal_loops[SIGNAL_LOOPS_MAX];
+static int s_signal_busy;	// handlers currently walking s_signal_loops
+static bool s_signal_wakeup = true;
+static const int s_signals[2] = { SIGINT, SIGTERM };
+static struct sigaction s_signal_chained[2];
+
+static void
+s_signal_handler(int signum, siginfo_t *info, void *context)
+{
+	int saved_errno = errno;
+
+	// first, so that the flags are set by the time the loops look
+	struct sigaction *chained = &s_signal_chained[signum==SIGINT ? 0 : 1];
+	if (chained->sa_flags & SA_SIGINFO)
+		chained->sa_sigaction(signum, info, context);
+	else if (chained->sa_handler!=SIG_DFL && chained->sa_handler!=SIG_IGN)
+		chained->sa_handler(signum);
+
+	__atomic_add_fetch(&s_signal_busy, 1, __ATOMIC_SEQ_CST);
+	int slot;
+	for (slot=0; slot < SIGNAL_LOOPS_MAX; slot++) {
+		zloop_t *zloop = __atomic_load_n(&s_signal_loops[slot], __ATOMIC_SEQ_CST);
+		if (zloop)
+			ev_async_send(zloop->evloop, &zloop->w_interrupted);
+	}
+	__atomic_sub_fetch(&s_signal_busy, 1, __ATOMIC_SEQ_CST);
+
+	errno = saved_errno;
+}
+
+static bool
+s_signal_is_ours(const struct sigaction *action)
+{
+	return (action->sa_flags & SA_SIGINFO) && action->sa_sigaction==s_signal_handler;
+}
+
+// (re)installs the handler in front of whatever is installed now.
+// without a handler to chain to, nothing would set the flags on a
+// signal, so leave it alone. called with s_signal_mutex held.
+static void
+s_signal_install(void)
+{
+	if (!s_signal_wakeup)
+		return;
+
+	int idx;
+	for (idx=0; idx < 2; idx++) {
+		struct sigaction current;
+		if (sigaction(s_signals[idx], NULL, &current)==-1)
+			continue;
+		if (s_signal_is_ours(&current))
+			continue;
+		if (!(current.sa_flags & SA_SIGINFO)
+				&& (current.sa_handler==SIG_DFL || current.sa_handler==SIG_IGN))
+			continue;
+
+		s_signal_chained[idx] = current;
+
+		struct sigaction action;
+		memset(&action, 0, sizeof(action));
+		action.sa_sigaction = s_signal_handler;
+		action.sa_flags = SA_SIGINFO | (current.sa_flags & SA_RESTART);
+		sigemptyset(&action.sa_mask);
+		sigaction(s_signals[idx], &action, NULL);
+	}
+}
+
+// puts back the handlers ours was chained to, where ours is still the
+// installed one. called with s_signal_mutex held.
+static void
+s_signal_uninstall(void)
+{
+	int idx;
+	for (idx=0; idx < 2; idx++) {
+		struct sigaction current;
+		if (sigaction(s_signals[idx], NULL, &current)==0 && s_signal_is_ours(&current))
+			sigaction(s_signals[idx], &s_signal_chained[idx], NULL);
+	}
+}
+
+static void
+s_interrupted_cb(struct ev_loop *evloop, ev_async *w, int revents)
+{
+	zloop_t *zloop = (zloop_t *)w->data;
+	if (s_interrupted(zloop)) {
 		ev_break(evloop, EVBREAK_ONE);
 	}
 }
+#endif
+
+// the flags are checked before each wait, which catches them being set
+// by a handler or by the application itself. the signal handler, when
+// installed, also wakes up a loop that is blocked.
+static void
+s_interrupt_watch(zloop_t *self)
+{
+	ev_prepare_start(self->evloop, &self->w_prepare_interrupted);
+	ev_unref(self->evloop);
+
+	#ifndef _WIN32
+	pthread_mutex_lock(&s_signal_mutex);
+	s_signal_install();
+	int slot;
+	for (slot=0; slot < SIGNAL_LOOPS_MAX; slot++) {
+		if (!s_signal_loops[slot]) {
+			__atomic_store_n(&s_signal_loops[slot], self, __ATOMIC_SEQ_CST);
+			self->signal_slot = slot;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&s_signal_mutex);
+	#endif
+}
+
+static void
+s_interrupt_unwatch(zloop_t *self)
+{
+	#ifndef _WIN32
+	if (self->signal_slot >= 0) {
+		pthread_mutex_lock(&s_signal_mutex);
+		__atomic_store_n(&s_signal_loops[self->signal_slot], NULL, __ATOMIC_SEQ_CST);
+		pthread_mutex_unlock(&s_signal_mutex);
+		self->signal_slot = -1;
+
+		// a handler on another thread may still hold the pointer
+		while (__atomic_load_n(&s_signal_busy, __ATOMIC_SEQ_CST))
+			sched_yield();
+	}
+	#endif
+
+	ev_ref(self->evloop);
+	ev_prepare_stop(self->evloop, &self->w_prepare_interrupted);
+}
+
+static void
+s_ticket_link(zloop_t *self, s_ticket_t *ticket)
+{
+	ticket->prev = self->tickets_tail;
+	ticket->next = NULL;
+	if (self->tickets_tail)
+		self->tickets_tail->next = ticket;
+	else
+		self->tickets_head = ticket;
+	self->tickets_tail = ticket;
+}
+
+static void
+s_ticket_unlink(zloop_t *self, s_ticket_t *ticket)
+{
+	if (ticket->prev)
+		ticket->prev->next = ticket->next;
+	else
+		self->tickets_head = ticket->next;
+	if (ticket->next)
+		ticket->next->prev = ticket->prev;
+	else
+		self->tickets_tail = ticket->prev;
+}
+
+static void
+s_tickets_arm(zloop_t *self)
+{
+	if (!self->tickets_head || ev_is_active(&self->w_tickets))
+		return;
+
+	ev_tstamp after = self->tickets_head->when - ev_now(self->evloop);
+	ev_timer_set(&self->w_tickets, after > 0.0 ? after : 0.0, 0.0);
+	ev_timer_start(self->evloop, &self->w_tickets);
+}
+
+static void
+s_tickets_cb(struct ev_loop *evloop, ev_timer *wt, int revents)
+{
+	zloop_t *zloop = (zloop_t *)wt->data;
+	ev_tstamp now = ev_now(evloop);
+
+	// like CZMQ, a ticket is gone once it has fired
+	s_ticket_t *ticket;
+	while ((ticket = zloop->tickets_head) && ticket->when <= now) {
+		s_ticket_unlink(zloop, ticket);
+
+		zloop->firing_ticket = ticket;		// read-only by zloop_ticket_reset/delete()
+		int rc = ticket->handler(zloop, 0, ticket->arg);
+		zloop->firing_ticket = NULL;
+
+		s_slab_put(&zloop->ticket_slab, ticket);
+
+		if (rc!=0) {
+			zloop->canceled = true;
+			ev_break(evloop, EVBREAK_ONE);
+			break;
+		}
+	}
+
+	s_tickets_arm(zloop);
+}
+
+static void
+s_post_push(zloop_t *self, s_post_t *post)
+{
+	__atomic_store_n(&post->next, NULL, __ATOMIC_RELAXED);
+	s_post_t *prev = __atomic_exchange_n(&self->post_head, post, __ATOMIC_ACQ_REL);
+	__atomic_store_n(&prev->next, post, __ATOMIC_RELEASE);
+}
+
+// loop thread only. returns false when the cache is full.
+static bool
+s_post_cache_put(zloop_t *self, s_post_t *post)
+{
+	size_t pos = self->post_cache_put;
+	s_post_cell_t *cell = &self->post_cache[pos & (POST_CACHE_SIZE - 1)];
+	if (__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) != pos)
+		return false;
+
+	cell->post = post;
+	__atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+	self->post_cache_put = pos + 1;
+	return true;
+}
+
+// any thread. returns NULL when the cache is empty.
+static s_post_t *
+s_post_cache_take(zloop_t *self)
+{
+	size_t pos = __atomic_load_n(&self->post_cache_take, __ATOMIC_RELAXED);
+	for (;;) {
+		s_post_cell_t *cell = &self->post_cache[pos & (POST_CACHE_SIZE - 1)];
+		size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+		ptrdiff_t dif = (ptrdiff_t)seq - (ptrdiff_t)(pos + 1);
+		if (dif < 0)
+			return NULL;
+		if (dif > 0) {
+			// another thread took it
+			pos = __atomic_load_n(&self->post_cache_take, __ATOMIC_RELAXED);
+			continue;
+		}
+		if (__atomic_compare_exchange_n(&self->post_cache_take, &pos, pos + 1,
+				true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+			s_post_t *post = cell->post;
+			__atomic_store_n(&cell->seq, pos + POST_CACHE_SIZE, __ATOMIC_RELEASE);
+			return post;
+		}
+	}
+}
+
+// loop thread only. *busy is set when a producer is half way through
+// a push, the task will then be there on the next try.
+static s_post_t *
+s_post_pop(zloop_t *self, bool *busy)
+{
+	*busy = false;
+	s_post_t *tail = self->post_tail;
+	s_post_t *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+	if (tail==&self->post_stub) {
+		if (!next)
+			return NULL;
+		self->post_tail = next;
+		tail = next;
+		next = __atomic_load_n(&next->next, __ATOMIC_ACQUIRE);
+	}
+
+	if (next) {
+		self->post_tail = next;
+		return tail;
+	}
+
+	if (tail!=__atomic_load_n(&self->post_head, __ATOMIC_ACQUIRE)) {
+		*busy = true;
+		return NULL;
+	}
+
+	// tail is the last one, put the stub behind it
+	s_post_push(self, &self->post_stub);
+	next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+	if (next) {
+		self->post_tail = next;
+		return tail;
+	}
+	*busy = true;
+	return NULL;
+}
+
+static void
+s_posts_cb(struct ev_loop *evloop, ev_async *w, int revents)
+{
+	zloop_t *zloop = (zloop_t *)w->data;
+
+	int count;
+	for (count=0; count < POST_BATCH_MAX; count++) {
+		bool busy;
+		s_post_t *post = s_post_pop(zloop, &busy);
+		if (!post) {
+			if (busy)
+				ev_async_send(evloop, w);
+			return;
+		}
+
+		int rc = post->fn(zloop, post->arg);
+		if (!s_post_cache_put(zloop, post))
+			free(post);
+
+		if (rc!=0) {
+			zloop->canceled = true;
+			ev_break(evloop, EVBREAK_ONE);
+			break;
+		}
+	}
+
+	// come back for the rest
+	ev_async_send(evloop, w);
+}
 
 zloop_t *
 zloop_new()
@@ -73,16 +779,54 @@ zloop_new()
 	if (self) {
 		self->evloop = ev_loop_new(0);
 
-		ev_prepare *w_prepare = &self->w_prepare_interrupted;
-		ev_prepare_init(w_prepare, s_prepare_interrupted_cb);
-		ev_prepare_start(self->evloop, w_prepare);
-
-		self->pollers = NULL;
-		self->timers = NULL;
-		self->timers_reuse = NULL;
-		self->last_timer_id = 0;
+		// neither watcher keeps the loop alive on its own
+		#ifndef _WIN32
+		ev_async_init(&self->w_interrupted, s_interrupted_cb);
+		self->w_interrupted.data = self;
+		ev_async_start(self->evloop, &self->w_interrupted);
+		ev_unref(self->evloop);
+		self->signal_slot = -1;
+		#endif
+		ev_prepare_init(&self->w_prepare_interrupted, s_prepare_interrupted_cb);
+		self->w_prepare_interrupted.data = self;
+		self->nonstop = false;
+		self->ignore_interrupts = false;
+
+		s_slab_init(&self->poller_slab, sizeof(s_poller_t));
+		s_slab_init(&self->timer_slab, sizeof(s_timer_t));
+		memset(self->index, 0, sizeof(self->index));
+		self->timer_slack = 0.0;
+		self->timer_slots = NULL;
+		self->ntimer_slots = 0;
+		self->maxtimer_slots = 0;
+		self->free_slot_head = -1;
+		self->free_slot_tail = -1;
+
+		ev_init(&self->w_tickets, s_tickets_cb);
+		self->w_tickets.data = self;
+		s_slab_init(&self->ticket_slab, sizeof(s_ticket_t));
+		self->tickets_head = NULL;
+		self->tickets_tail = NULL;
+		self->ticket_delay = 0.0;
+		self->firing_ticket = NULL;
+
+		ev_async_init(&self->w_posts, s_posts_cb);
+		self->w_posts.data = self;
+		ev_set_priority(&self->w_posts, EV_MINPRI);
+		ev_async_start(self->evloop, &self->w_posts);
+		ev_unref(self->evloop);
+		self->post_stub.next = NULL;
+		self->post_head = &self->post_stub;
+		self->post_tail = &self->post_stub;
+		size_t cell;
+		for (cell=0; cell < POST_CACHE_SIZE; cell++)
+			self->post_cache[cell].seq = cell;
+		self->post_cache_put = 0;
+		self->post_cache_take = 0;
 
 		self->canceled = false;
+		self->errors = 0;
+		self->current_poller = NULL;
 
 		self->inside_cb_timer = false;
 	}
@@ -96,47 +840,106 @@ zloop_destroy(zloop_t **self_p)
 	if (*self_p) {
 		zloop_t *self = *self_p;
 
+		#ifndef _WIN32
+		ev_ref(self->evloop);
+		ev_async_stop(self->evloop, &self->w_interrupted);
+		#endif
+		ev_ref(self->evloop);
+		ev_async_stop(self->evloop, &self->w_posts);
+		ev_zsock_registry_destroy(self->evloop);
 		ev_loop_destroy(self->evloop);
 
-		{
-			s_poller_t *elt, *tmp;
-			DL_FOREACH_SAFE(self->pollers, elt, tmp) {
-				DL_DELETE(self->pollers, elt);
-				free(elt);
-			}
-		}
+		// tasks that never ran
+		s_post_t *post;
+		bool busy;
+		while ((post = s_post_pop(self, &busy)))
+			free(post);
+		while ((post = s_post_cache_take(self)))
+			free(post);
 
-		{
-			s_timer_t *elt, *tmp;
-			DL_FOREACH_SAFE(self->timers, elt, tmp) {
-				DL_DELETE(self->timers, elt);
-				free(elt);
-			}
-
-			DL_FOREACH_SAFE(self->timers_reuse, elt, tmp) {
-				DL_DELETE(self->timers_reuse, elt);
-				free(elt);
-			}
-		}
+		int which;
+		for (which=0; which < INDEX_COUNT; which++)
+			free(self->index[which].buckets);
+		free(self->timer_slots);
+
+		s_slab_destroy(&self->poller_slab);
+		s_slab_destroy(&self->timer_slab);
+		s_slab_destroy(&self->ticket_slab);
 
 		free (self);
 		*self_p = NULL;
 	}
 }
 
+static void s_poller_remove(zloop_t *self, s_poller_t *poller);
+
+static void
+s_fd_retry(struct ev_loop *evloop, ev_timer *w, int revents)
+{
+	s_poller_t *poller = (s_poller_t *)
+		(((char *)w) - offsetof(s_poller_t, w_retry));
+	zloop_t *zloop = (zloop_t *)poller->w_io.data;
+
+	#ifndef _WIN32
+	// libev would only fail it again
+	if (fcntl(poller->item.fd, F_GETFD)==-1 && errno==EBADF) {
+		poller->errors++;
+		zloop->errors++;
+		poller->backoff *= 2;
+		if (poller->backoff > EV_ZSOCK_BACKOFF_MAX)
+			poller->backoff = EV_ZSOCK_BACKOFF_MAX;
+		ev_timer_set(&poller->w_retry, poller->backoff, 0.);
+		ev_timer_start(evloop, &poller->w_retry);
+		return;
+	}
+	#endif
+
+	ev_io_start(evloop, &poller->w_io);
+}
+
+static void
+s_fd_park(zloop_t *zloop, s_poller_t *poller)
+{
+	ev_io_stop(zloop->evloop, &poller->w_io);
+	poller->backoff = EV_ZSOCK_BACKOFF_MIN;
+	ev_timer_set(&poller->w_retry, poller->backoff, 0.);
+	ev_timer_start(zloop->evloop, &poller->w_retry);
+}
+
 static void
 s_handler_shim(struct ev_loop *evloop, zloop_t *zloop, s_poller_t *poller, int revents)
 {
 	poller->item.revents = (revents & EV_READ ? ZMQ_POLLIN : 0)
-			| (revents & EV_WRITE ? ZMQ_POLLOUT : 0);
+			| (revents & EV_WRITE ? ZMQ_POLLOUT : 0)
+			| (revents & EV_ERROR ? ZMQ_POLLERR : 0);
+
+	if (revents & EV_ERROR) {
+		poller->errors++;
+		zloop->errors++;
+	}
 
+	zloop->current_poller = poller;
 	int rc;
-	if (poller->sock) {
+	if (poller->multipart) {
+		// only errors come this way
+		rc = poller->handler_multipart(zloop, poller->sock, NULL, 0, poller->arg);
+	} else if (poller->sock) {
 		rc = poller->handler_reader(zloop, poller->sock, poller->arg);
 	} else {
 		rc = poller->handler_poller(zloop, &poller->item, poller->arg);
 	}
 
+	// like CZMQ, drop a poller that is not tolerant of errors.
+	// a tolerant socket stays parked by ev_zsock until it recovers,
+	// libev already stopped a failed fd, which gets retried.
+	if ((revents & EV_ERROR) && zloop->current_poller==poller) {
+		if (!poller->tolerant)
+			s_poller_remove(zloop, poller);
+		else if (!poller->item.socket)
+			s_fd_park(zloop, poller);
+	}
+	zloop->current_poller = NULL;
+
 	if (rc!=0) {
 		zloop->canceled = true;
 		ev_break(evloop, EVBREAK_ONE);
@@ -152,6 +955,25 @@ s_zsock_shim(struct ev_loop *evloop, ev_zsock_t *wz, int revents)
 	s_handler_shim(evloop, zloop, poller, revents);
 }
 
+// ev_zsock_frame_t and zloop_frame_t share their layout
+static void
+s_multipart_shim(struct ev_loop *evloop, ev_zsock_t *wz,
+		const ev_zsock_frame_t *frames, zmq_msg_t *msgs, int count)
+{
+	s_poller_t *poller = (s_poller_t *)wz;
+	zloop_t *zloop = (zloop_t *)wz->data;
+
+	zloop->current_poller = poller;
+	int rc = poller->handler_multipart(zloop, poller->sock,
+			(const zloop_frame_t *)frames, count, poller->arg);
+	zloop->current_poller = NULL;
+
+	if (rc!=0) {
+		zloop->canceled = true;
+		ev_break(evloop, EVBREAK_ONE);
+	}
+}
+
 static void
 s_fd_shim(struct ev_loop *evloop, ev_io *wio, int revents)
 {
@@ -164,7 +986,7 @@ s_fd_shim(struct ev_loop *evloop, ev_io *wio, int revents)
 static s_poller_t *
 s_poller_reader_new(zloop_t *zloop, zmq_pollitem_t *item)
 {
-	s_poller_t *poller = (s_poller_t *)malloc(sizeof(s_poller_t));
+	s_poller_t *poller = (s_poller_t *)s_slab_get(&zloop->poller_slab);
 	if (poller) {
 		int events = (item->events & ZMQ_POLLIN ? EV_READ : 0)
 				| (item->events & ZMQ_POLLOUT ? EV_WRITE : 0);
@@ -180,8 +1002,12 @@ s_poller_reader_new(zloop_t *zloop, zmq_pollitem_t *item)
 			wio->data = zloop;
 			ev_io_start(zloop->evloop, wio);
 		}
+		ev_init(&poller->w_retry, s_fd_retry);
 
 		poller->item = *item;
+		poller->multipart = false;
+		poller->tolerant = false;
+		poller->errors = 0;
 	}
 	return poller;
 }
@@ -201,7 +1027,7 @@ s_poller_new(zloop_t *zloop, zmq_pollitem_t *item, zloop_fn handler, void *arg)
 static s_poller_t *
 s_reader_new(zloop_t *zloop, zsock_t *sock, zloop_reader_fn handler, void *arg)
 {
-	zmq_pollitem_t item = { zsock_resolve(sock), 0, ZMQ_POLLIN };
+	zmq_pollitem_t item = { .socket = zsock_resolve(sock), .events = ZMQ_POLLIN };
 	s_poller_t *poller = s_poller_reader_new(zloop, &item);
 	if (poller) {
 		poller->sock = sock;
@@ -211,6 +1037,61 @@ s_reader_new(zloop_t *zloop, zsock_t *sock, zloop_reader_fn handler, void *arg)
 	return poller;
 }
 
+static s_poller_t *
+s_multipart_reader_new(zloop_t *zloop, zsock_t *sock, zloop_multipart_fn handler, void *arg)
+{
+	zmq_pollitem_t item = { .socket = zsock_resolve(sock), .events = ZMQ_POLLIN };
+	s_poller_t *poller = s_poller_reader_new(zloop, &item);
+	if (poller) {
+		poller->sock = sock;
+		poller->handler_multipart = handler;
+		poller->arg = arg;
+		poller->multipart = true;
+		ev_zsock_set_multipart(&poller->w_zsock, s_multipart_shim, ZLOOP_MULTIPART_BATCH);
+	}
+	return poller;
+}
+
+static void
+s_poller_destroy(zloop_t *self, s_poller_t *poller)
+{
+	if (poller->item.socket)
+		ev_zsock_stop(self->evloop, &poller->w_zsock);
+	else
+		ev_io_stop(self->evloop, &poller->w_io);
+	ev_timer_stop(self->evloop, &poller->w_retry);
+	s_slab_put(&self->poller_slab, poller);
+}
+
+static int
+s_poller_add(zloop_t *self, s_poller_t *poller)
+{
+	if (s_index_insert(&self->index[INDEX_BY_HANDLE], INDEX_BY_HANDLE, poller)==-1) {
+		s_poller_destroy(self, poller);
+		return -1;
+	}
+
+	if (poller->sock &&
+			s_index_insert(&self->index[INDEX_BY_SOCK], INDEX_BY_SOCK, poller)==-1) {
+		s_index_remove(&self->index[INDEX_BY_HANDLE], INDEX_BY_HANDLE, poller);
+		s_poller_destroy(self, poller);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void
+s_poller_remove(zloop_t *self, s_poller_t *poller)
+{
+	if (self->current_poller==poller)
+		self->current_poller = NULL;
+	s_index_remove(&self->index[INDEX_BY_HANDLE], INDEX_BY_HANDLE, poller);
+	if (poller->sock)
+		s_index_remove(&self->index[INDEX_BY_SOCK], INDEX_BY_SOCK, poller);
+	s_poller_destroy(self, poller);
+}
+
 int
 zloop_poller(zloop_t *self, zmq_pollitem_t *item, zloop_fn handler, void *arg)
 {
@@ -219,53 +1100,99 @@ zloop_poller(zloop_t *self, zmq_pollitem_t *item, zloop_fn handler, void *arg)
 	s_poller_t *poller = s_poller_new(self, item, handler, arg);
 	if (!poller)
 		return -1;
-	DL_APPEND(self->pollers, poller);
 
-	return 0;
+	return s_poller_add(self, poller);
 }
 
+typedef void (s_poller_fn)(zloop_t *self, s_poller_t *poller, void *arg);
+
+// calls fn on every registration of the socket or fd, which it may remove.
+// only the entries sharing the key's bucket get visited.
 static void
-s_poller_reader_end(zloop_t *self, zsock_t *sock, zmq_pollitem_t *item)
+s_poller_reader_foreach(zloop_t *self, zsock_t *sock, zmq_pollitem_t *item,
+		s_poller_fn *fn, void *arg)
 {
 	assert(self);
 	assert(sock || item);
 
-	s_poller_t *poller, *tmp;
-	DL_FOREACH_SAFE(self->pollers, poller, tmp) {
-		bool found = false;
-		if (sock) {
-			if (sock == poller->sock) {
-				found = true;
-				ev_zsock_stop(self->evloop, &poller->w_zsock);
-			}
-		} else if (item->socket) {
-			if (item->socket == poller->item.socket) {
-				found = true;
-				ev_zsock_stop(self->evloop, &poller->w_zsock);
-			}
-		} else {
-			if (item->fd == poller->item.fd) {
-				found = true;
-				ev_io_stop(self->evloop, &poller->w_io);
-			}
-		}
-
-		if (found) {
-			DL_DELETE(self->pollers, poller);
-			free(poller);
-		}
+	int which = sock ? INDEX_BY_SOCK : INDEX_BY_HANDLE;
+	s_index_t *index = &self->index[which];
+	if (!index->buckets)
+		return;
+
+	uintptr_t key = sock ? (uintptr_t)sock
+		: item->socket ? (uintptr_t)item->socket : (uintptr_t)item->fd;
+
+	s_poller_t *poller = index->buckets[s_index_bucket(index, key)];
+	while (poller) {
+		s_poller_t *next = poller->hlink[which].next;
+
+		bool found;
+		if (sock)
+			found = sock == poller->sock;
+		else if (item->socket)
+			found = item->socket == poller->item.socket;
+		else
+			found = !poller->item.socket && item->fd == poller->item.fd;
+
+		if (found)
+			fn(self, poller, arg);
+		poller = next;
 	}
 }
 
+static void
+s_poller_end_fn(zloop_t *self, s_poller_t *poller, void *arg)
+{
+	s_poller_remove(self, poller);
+}
+
+static void
+s_poller_tolerant_fn(zloop_t *self, s_poller_t *poller, void *arg)
+{
+	poller->tolerant = true;
+}
+
+static void
+s_poller_busy_poll_fn(zloop_t *self, s_poller_t *poller, void *arg)
+{
+	if (poller->item.socket)
+		ev_zsock_set_busy_poll(&poller->w_zsock, *(ev_tstamp *)arg);
+}
+
+static void
+s_poller_errors_fn(zloop_t *self, s_poller_t *poller, void *arg)
+{
+	*(size_t *)arg += poller->errors;
+}
+
+// like CZMQ, these act on every registration of the socket or fd
+
 void
 zloop_poller_end(zloop_t *self, zmq_pollitem_t *item)
 {
-	s_poller_reader_end(self, NULL, item);
+	s_poller_reader_foreach(self, NULL, item, s_poller_end_fn, NULL);
 }
 
 void
 zloop_poller_set_tolerant(zloop_t *self, zmq_pollitem_t *item)
 {
+	s_poller_reader_foreach(self, NULL, item, s_poller_tolerant_fn, NULL);
+}
+
+void
+zloop_poller_set_busy_poll(zloop_t *self, zmq_pollitem_t *item, size_t max_spin)
+{
+	ev_tstamp max_spin_sec = max_spin * 1e-6;
+	s_poller_reader_foreach(self, NULL, item, s_poller_busy_poll_fn, &max_spin_sec);
+}
+
+size_t
+zloop_poller_errors(zloop_t *self, zmq_pollitem_t *item)
+{
+	size_t errors = 0;
+	s_poller_reader_foreach(self, NULL, item, s_poller_errors_fn, &errors);
+	return errors;
 }
 
 int
@@ -274,20 +1201,70 @@ zloop_reader(zloop_t *self, zsock_t *sock, zloop_reader_fn handler, void *arg)
 	s_poller_t *poller = s_reader_new(self, sock, handler, arg);
 	if (!poller)
 		return -1;
-	DL_APPEND(self->pollers, poller);
 
-	return 0;
+	return s_poller_add(self, poller);
+}
+
+int
+zloop_multipart_reader(zloop_t *self, zsock_t *sock, zloop_multipart_fn handler, void *arg)
+{
+	s_poller_t *poller = s_multipart_reader_new(self, sock, handler, arg);
+	if (!poller)
+		return -1;
+
+	return s_poller_add(self, poller);
 }
 
 void
 zloop_reader_end(zloop_t *self, zsock_t *sock)
 {
-	s_poller_reader_end(self, sock, NULL);
+	s_poller_reader_foreach(self, sock, NULL, s_poller_end_fn, NULL);
 }
 
 void
 zloop_reader_set_tolerant(zloop_t *self, zsock_t *sock)
 {
+	s_poller_reader_foreach(self, sock, NULL, s_poller_tolerant_fn, NULL);
+}
+
+void
+zloop_reader_set_busy_poll(zloop_t *self, zsock_t *sock, size_t max_spin)
+{
+	ev_tstamp max_spin_sec = max_spin * 1e-6;
+	s_poller_reader_foreach(self, sock, NULL, s_poller_busy_poll_fn, &max_spin_sec);
+}
+
+size_t
+zloop_reader_errors(zloop_t *self, zsock_t *sock)
+{
+	size_t errors = 0;
+	s_poller_reader_foreach(self, sock, NULL, s_poller_errors_fn, &errors);
+	return errors;
+}
+
+size_t
+zloop_errors(zloop_t *self)
+{
+	assert(self);
+	return self->errors;
+}
+
+// timers due within the same slack window expire at the same instant,
+// so libev runs them in a single wakeup
+static void
+s_timer_arm(zloop_t *zloop, s_timer_t *timer)
+{
+	// rounded up without ceil(), which would need -lm. due is positive,
+	// so the cast rounds down.
+	int64_t slots = (int64_t)(timer->due / timer->slack);
+	if (slots * timer->slack < timer->due)
+		slots++;
+	ev_tstamp at = slots * timer->slack;
+	ev_tstamp after = at - ev_now(zloop->evloop);
+
+	ev_timer_stop(zloop->evloop, &timer->w_timer);
+	ev_timer_set(&timer->w_timer, after > 0.0 ? after : 0.0, 0.0);
+	ev_timer_start(zloop->evloop, &timer->w_timer);
 }
 
 static void
@@ -306,9 +1283,13 @@ s_timer_shim(struct ev_loop *evloop, ev_timer *wt, int revents)
 	zloop->inside_cb_timer = false;
 
 	if (zloop->timer_delete_requested || (timer->times > 0 && --timer->times==0)) {
-		DL_DELETE(zloop->timers, timer);
-		ev_timer_stop(zloop->evloop, &timer->w_timer);
-		DL_APPEND(zloop->timers_reuse, timer);
+		s_timer_free(zloop, timer);
+	} else if (timer->slack > 0.0) {
+		// like libev's repeat: no drift, but no catching up either
+		timer->due += timer->interval;
+		if (timer->due < ev_now(evloop))
+			timer->due = ev_now(evloop);
+		s_timer_arm(zloop, timer);
 	}
 
 	if (rc!=0) {
@@ -318,15 +1299,23 @@ s_timer_shim(struct ev_loop *evloop, ev_timer *wt, int revents)
 }
 
 static void
-s_timer_init(zloop_t *zloop, s_timer_t *timer, int timer_id, size_t delay, size_t times, zloop_timer_fn handler, void *arg)
+s_timer_init(zloop_t *zloop, s_timer_t *timer, size_t delay, size_t times, zloop_timer_fn handler, void *arg)
 {
 	ev_timer *w_timer = &timer->w_timer;
 	double delay_sec = delay * 1e-3;
 	ev_timer_init(w_timer, s_timer_shim, 0.0, delay_sec);
 	timer->w_timer.data = zloop;
-	ev_timer_again(zloop->evloop, &timer->w_timer);
 
-	timer->timer_id = timer_id;
+	timer->interval = delay_sec;
+	timer->slack = delay_sec > 0.0 ? zloop->timer_slack : 0.0;
+	if (timer->slack > 0.0) {
+		timer->due = ev_now(zloop->evloop) + delay_sec;
+		s_timer_arm(zloop, timer);
+	} else {
+		ev_timer_again(zloop->evloop, &timer->w_timer);
+	}
+
+	timer->active = true;
 	timer->times = times;
 	timer->handler = handler;
 	timer->arg = arg;
@@ -337,24 +1326,13 @@ zloop_timer(zloop_t *self, size_t delay, size_t times, zloop_timer_fn handler, v
 {
 	assert(self);
 
-	s_timer_t *timer;
-	int timer_id;
-
-	if (self->timers_reuse) {
-		timer = self->timers_reuse;
-		timer_id = timer->timer_id;
-		DL_DELETE(self->timers_reuse, timer); 
-	} else {
-		timer = (s_timer_t *)malloc(sizeof(*timer));
-		if (!timer)
-			return -1;
-		timer_id = s_next_timer_id(self);
-	}
+	s_timer_t *timer = s_timer_alloc(self);
+	if (!timer)
+		return -1;
 
-	s_timer_init(self, timer, timer_id, delay, times, handler, arg);
-	DL_APPEND(self->timers, timer);
+	s_timer_init(self, timer, delay, times, handler, arg);
 
-	return timer_id;
+	return timer->timer_id;
 }
 
 int
@@ -364,36 +1342,221 @@ zloop_timer_end(zloop_t *self, int timer_id)
 
 	// if timer callback tried to delete itself, we let
 	// s_timer_shim do it
-	// also has the advantage that we do not need to walk timers list
 	if (self->inside_cb_timer && self->inside_cb_timer_id==timer_id) {
 		self->timer_delete_requested = true;
 		return 0;
 	}
 
-	s_timer_t *timer, *tmp;
-	DL_FOREACH_SAFE(self->timers, timer, tmp) {
-		if (timer_id==timer->timer_id) {
-			DL_DELETE(self->timers, timer);
-			ev_timer_stop(self->evloop, &timer->w_timer);
-			DL_APPEND(self->timers_reuse, timer);
-		}
+	s_timer_t *timer = s_timer_lookup(self, timer_id);
+	if (timer)
+		s_timer_free(self, timer);
+
+	return 0;
+}
+
+void
+zloop_set_timer_slack(zloop_t *self, size_t slack)
+{
+	assert(self);
+	self->timer_slack = slack * 1e-3;
+}
+
+int
+zloop_timer_set_slack(zloop_t *self, int timer_id, size_t slack)
+{
+	assert(self);
+
+	s_timer_t *timer = s_timer_lookup(self, timer_id);
+	if (!timer)
+		return -1;
+	ev_tstamp slack_sec = slack * 1e-3;
+	if (timer->interval==0.0 || timer->slack==slack_sec)
+		return 0;
+
+	// from its own handler, due is the expiry being handled and
+	// s_timer_shim is yet to move it on
+	bool firing = self->inside_cb_timer && self->inside_cb_timer_id==timer_id;
+	ev_tstamp now = ev_now(self->evloop);
+
+	if (timer->slack==0.0) {
+		// from libev's repeat to our own re-arming
+		timer->due = firing ? now
+			: now + ev_timer_remaining(self->evloop, &timer->w_timer);
+	} else if (firing && slack_sec==0.0) {
+		timer->due += timer->interval;
 	}
+	timer->slack = slack_sec;
+
+	if (slack_sec > 0.0) {
+		s_timer_arm(self, timer);
+	} else {
+		ev_tstamp after = timer->due - now;
+		ev_timer_stop(self->evloop, &timer->w_timer);
+		ev_timer_set(&timer->w_timer, after > 0.0 ? after : 0.0, timer->interval);
+		ev_timer_start(self->evloop, &timer->w_timer);
+	}
+	return 0;
+}
+
+void *
+zloop_ticket(zloop_t *self, zloop_timer_fn handler, void *arg)
+{
+	assert(self);
+	assert(self->ticket_delay > 0.0);
+
+	s_ticket_t *ticket = (s_ticket_t *)s_slab_get(&self->ticket_slab);
+	if (!ticket)
+		return NULL;
+
+	ticket->when = ev_now(self->evloop) + self->ticket_delay;
+	ticket->handler = handler;
+	ticket->arg = arg;
+	s_ticket_link(self, ticket);
+	s_tickets_arm(self);
+
+	return ticket;
+}
+
+void
+zloop_ticket_reset(zloop_t *self, void *handle)
+{
+	assert(self);
+	assert(handle);
+
+	s_ticket_t *ticket = (s_ticket_t *)handle;
+	if (ticket==self->firing_ticket)
+		return;
+
+	ticket->when = ev_now(self->evloop) + self->ticket_delay;
+	if (ticket!=self->tickets_tail) {
+		s_ticket_unlink(self, ticket);
+		s_ticket_link(self, ticket);
+	}
+}
+
+void
+zloop_ticket_delete(zloop_t *self, void *handle)
+{
+	assert(self);
+	assert(handle);
+
+	s_ticket_t *ticket = (s_ticket_t *)handle;
+	if (ticket==self->firing_ticket)
+		return;		// s_tickets_cb frees it
+
+	s_ticket_unlink(self, ticket);
+	s_slab_put(&self->ticket_slab, ticket);
+}
+
+// as in CZMQ, changing the delay while tickets exist leaves them
+// out of order, set it up front
+void
+zloop_set_ticket_delay(zloop_t *self, size_t ticket_delay)
+{
+	assert(self);
+	self->ticket_delay = ticket_delay * 1e-3;
+}
+
+int
+zloop_reserve(zloop_t *self, size_t npollers, size_t ntimers)
+{
+	assert(self);
+
+	if (s_slab_reserve(&self->poller_slab, npollers)==-1)
+		return -1;
+
+	// timers freed back into the slot table are not in the slab
+	size_t nslots = self->ntimer_slots + ntimers;
+	if (nslots > TIMER_SLOT_MAX)
+		nslots = TIMER_SLOT_MAX;
+	if (s_timer_slots_grow(self, (int)nslots)==-1)
+		return -1;
+	if (s_slab_reserve(&self->timer_slab, nslots - self->ntimer_slots)==-1)
+		return -1;
 
 	return 0;
 }
 
+int
+zloop_post(zloop_t *self, zloop_post_fn handler, void *arg)
+{
+	assert(self);
+
+	s_post_t *post = s_post_cache_take(self);
+	if (!post)
+		post = (s_post_t *)malloc(sizeof(*post));
+	if (!post)
+		return -1;
+	post->fn = handler;
+	post->arg = arg;
+
+	s_post_push(self, post);
+	ev_async_send(self->evloop, &self->w_posts);
+	return 0;
+}
+
+void
+zloop_set_post_order(zloop_t *self, int order)
+{
+	assert(self);
+	assert(order==ZLOOP_POST_BEFORE || order==ZLOOP_POST_AFTER);
+
+	// the priority of a watcher can only change while it is stopped
+	ev_ref(self->evloop);
+	ev_async_stop(self->evloop, &self->w_posts);
+	ev_set_priority(&self->w_posts, order==ZLOOP_POST_BEFORE ? EV_MAXPRI : EV_MINPRI);
+	ev_async_start(self->evloop, &self->w_posts);
+	ev_unref(self->evloop);
+
+	// in case a wakeup got lost with the stop
+	ev_async_send(self->evloop, &self->w_posts);
+}
+
 void
 zloop_set_verbose(zloop_t *self, bool verbose)
 {
 }
 
+void
+zloop_set_nonstop(zloop_t *self, bool nonstop)
+{
+	assert(self);
+	self->nonstop = nonstop;
+}
+
+void
+zloop_ignore_interrupts(zloop_t *self)
+{
+	assert(self);
+	self->ignore_interrupts = true;
+}
+
+void
+zloop_set_signal_wakeup(bool enable)
+{
+	#ifndef _WIN32
+	pthread_mutex_lock(&s_signal_mutex);
+	s_signal_wakeup = enable;
+	if (!enable)
+		s_signal_uninstall();
+	pthread_mutex_unlock(&s_signal_mutex);
+	#endif
+}
+
 int
 zloop_start(zloop_t *self)
 {
 	assert(self);
 
 	self->canceled = false;
-	ev_run(self->evloop, 0);
+	if (s_interrupted(self))
+		return 0;
+
+	s_interrupt_watch(self);
+	// a signal may have come in before we were registered
+	if (!s_interrupted(self))
+		ev_run(self->evloop, 0);
+	s_interrupt_unwatch(self);
 
 	return self->canceled ? -1 : 0;
 }
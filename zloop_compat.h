@@ -0,0 +1,87 @@
+#ifndef ZLOOP_COMPAT_H_
+#define ZLOOP_COMPAT_H_
+
+#include <czmq.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// extensions to CZMQ's zloop API, only provided by zloop_compat
+
+// preallocates room for that many more pollers/readers and timers,
+// so that registering them does not hit malloc. returns -1 on failure.
+int zloop_reserve(zloop_t *self, size_t npollers, size_t ntimers);
+
+// same as in recent CZMQ: zsys_interrupted no longer stops this loop
+void zloop_ignore_interrupts(zloop_t *self);
+
+// zloop_start() checks zsys_interrupted/zctx_interrupted on each wakeup.
+// so that a blocked loop wakes up on SIGINT/SIGTERM, it also installs a
+// process-wide sigaction for both, chained in front of the handler found
+// there (CZMQ's, unless replaced). it is put back in front at each
+// zloop_start() and never sets the flags itself, so a chained handler
+// that does not set them does not stop the loops. nothing is installed
+// over SIG_DFL/SIG_IGN, e.g. after zsys_handler_set(NULL).
+// zloop_set_signal_wakeup(false) opts out: the original handlers are put
+// back, and loops see the flags only once woken up by other events.
+void zloop_set_signal_wakeup(bool enable);
+
+// errors reported to the loop's pollers, to the pollers/readers
+// registered for a socket or fd, and to the readers of a zsock_t.
+// a tolerant socket or fd reports its error once, then gets retried with
+// exponential backoff until it recovers.
+size_t zloop_errors(zloop_t *self);
+size_t zloop_poller_errors(zloop_t *self, zmq_pollitem_t *item);
+size_t zloop_reader_errors(zloop_t *self, zsock_t *sock);
+
+// spin on the socket for up to max_spin microseconds before blocking,
+// see ev_zsock_set_busy_poll(). fd pollers are not affected.
+void zloop_poller_set_busy_poll(zloop_t *self, zmq_pollitem_t *item, size_t max_spin);
+void zloop_reader_set_busy_poll(zloop_t *self, zsock_t *sock, size_t max_spin);
+
+// a reader that gets whole messages, as frames pointing into zmq_msg_t
+// that are closed once handler returns: nothing is copied and a partial
+// message is never seen. up to ZLOOP_MULTIPART_BATCH messages are handled
+// per wakeup. on a socket error handler is called with no frames.
+// ended with zloop_reader_end(). returns -1 on failure.
+typedef struct {
+	void *data;
+	size_t size;
+} zloop_frame_t;
+
+#define ZLOOP_MULTIPART_BATCH 64
+typedef int (zloop_multipart_fn) (zloop_t *loop, zsock_t *reader,
+		const zloop_frame_t *frames, size_t nframes, void *arg);
+int zloop_multipart_reader(zloop_t *self, zsock_t *sock,
+		zloop_multipart_fn handler, void *arg);
+
+// timer slack, in msecs: a timer may fire up to that late, rounded up to
+// a multiple of its slack, so that timers due close together share one
+// wakeup and run as a batch. the loop's slack applies to timers created
+// afterwards, zloop_timer_set_slack() changes that of an existing timer
+// (-1 if it is gone). 0, the default, keeps expiries exact.
+void zloop_set_timer_slack(zloop_t *self, size_t slack);
+int zloop_timer_set_slack(zloop_t *self, int timer_id, size_t slack);
+
+// runs handler(self, arg) on the loop's thread; callable from any thread.
+// like other handlers, returning non-zero ends zloop_start() with -1.
+// pending tasks do not keep zloop_start() from returning, and the ones
+// still queued when the loop is destroyed are dropped.
+// tasks that ran are kept for reuse, so that a steady stream of posts
+// does not hit malloc. returns -1 if the task could not be allocated.
+typedef int (zloop_post_fn) (zloop_t *loop, void *arg);
+int zloop_post(zloop_t *self, zloop_post_fn handler, void *arg);
+
+// whether posted tasks run before or after the socket handlers of the
+// same wakeup (the default). call it from the loop's thread.
+#define ZLOOP_POST_BEFORE 0
+#define ZLOOP_POST_AFTER 1
+void zloop_set_post_order(zloop_t *self, int order);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
@@ -1,4 +1,11 @@
 #include <czmq.h>
+#ifndef _WIN32
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#endif
+
+#include "zloop_compat.h"
 
 static int
 s_cancel_timer_event(zloop_t *zloop, int timer_id, void *arg)
@@ -79,8 +86,384 @@ zloop_compat_test()
 	zmq_ctx_destroy(zctx);
 }
 
-int main()
+// self checks of the extensions and of the parts zloop_compat rewrote
+
+static int
+s_stop(zloop_t *zloop, int timer_id, void *arg)
+{
+	return -1;
+}
+
+// a timer runs the given number of times, or until ended
+
+static int
+s_count_timer(zloop_t *zloop, int timer_id, void *arg)
+{
+	int *count = (int *)arg;
+	if (++*count==4)
+		return zloop_timer_end(zloop, timer_id);
+	return 0;
+}
+
+static void
+s_check_timer(void)
+{
+	zloop_t *zloop = zloop_new();
+
+	int times = 0, forever = 0;
+	zloop_timer(zloop, 5, 3, s_count_timer, &times);
+	zloop_timer(zloop, 5, 0, s_count_timer, &forever);
+	int timer_id = zloop_timer(zloop, 5, 0, s_count_timer, &forever);
+	assert(zloop_timer_end(zloop, timer_id)==0);
+
+	zloop_timer(zloop, 100, 1, s_stop, NULL);
+	assert(zloop_start(zloop)==-1);
+	assert(times==3 && forever==4);
+	zloop_destroy(&zloop);
+
+	// a slot is retired before its ids could repeat
+	zloop = zloop_new();
+	int first = zloop_timer(zloop, 1000, 1, s_stop, NULL);
+	zloop_timer_end(zloop, first);
+	int idx;
+	for (idx=0; idx < 10000; idx++) {
+		timer_id = zloop_timer(zloop, 1000, 1, s_stop, NULL);
+		assert(timer_id > 0 && timer_id!=first);
+		zloop_timer_end(zloop, timer_id);
+	}
+	zloop_destroy(&zloop);
+}
+
+// tickets expire in the order they were last reset, a deleted one never
+
+static char s_fired[4];
+static int s_nfired;
+static void *s_tickets[3];
+
+static int
+s_ticket_fired(zloop_t *zloop, int timer_id, void *arg)
+{
+	s_fired[s_nfired++] = *(const char *)arg;
+	return 0;
+}
+
+static int
+s_ticket_change(zloop_t *zloop, int timer_id, void *arg)
+{
+	zloop_ticket_reset(zloop, s_tickets[0]);
+	zloop_ticket_delete(zloop, s_tickets[2]);
+	return 0;
+}
+
+static void
+s_check_ticket(void)
+{
+	zloop_t *zloop = zloop_new();
+	zloop_set_ticket_delay(zloop, 40);
+
+	s_tickets[0] = zloop_ticket(zloop, s_ticket_fired, "a");
+	s_tickets[1] = zloop_ticket(zloop, s_ticket_fired, "b");
+	s_tickets[2] = zloop_ticket(zloop, s_ticket_fired, "c");
+
+	zloop_timer(zloop, 20, 1, s_ticket_change, NULL);
+	zloop_timer(zloop, 150, 1, s_stop, NULL);
+	assert(zloop_start(zloop)==-1);
+	assert(s_nfired==2 && !strcmp(s_fired, "ba"));
+
+	zloop_destroy(&zloop);
+}
+
+#ifndef _WIN32
+
+// SIGINT wakes up a blocked loop, which ends if the flags got set,
+// unless interrupts are ignored
+
+static int s_chained;
+
+// stands in for the handler CZMQ installs
+static void
+s_czmq_handler(int signum)
+{
+	zsys_interrupted = 1;
+	s_chained++;
+}
+
+// stands in for an application's own handler
+static void
+s_app_handler(int signum)
+{
+	s_chained++;
+}
+
+static void *
+s_kill_thread(void *arg)
+{
+	usleep(10000);
+	kill(getpid(), SIGINT);
+	return NULL;
+}
+
+static int
+s_raise(zloop_t *zloop, int timer_id, void *arg)
+{
+	raise(SIGINT);
+	return 0;
+}
+
+static int
+s_interrupt(zloop_t *zloop, int timer_id, void *arg)
+{
+	zsys_interrupted = 1;
+	return 0;
+}
+
+// starts a loop that a signal handled on another thread has to wake up
+static int
+s_start_killed(zloop_t *zloop)
+{
+	pthread_t thread;
+	pthread_create(&thread, NULL, s_kill_thread, NULL);
+	sigset_t mask, saved;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	pthread_sigmask(SIG_BLOCK, &mask, &saved);
+
+	zloop_timer(zloop, 1000, 1, s_stop, NULL);
+	int rc = zloop_start(zloop);
+	pthread_join(thread, NULL);
+	pthread_sigmask(SIG_SETMASK, &saved, NULL);
+	zloop_destroy(&zloop);
+	zsys_interrupted = zctx_interrupted = 0;
+	return rc;
+}
+
+static void
+s_check_signal(void)
+{
+	void (*previous)(int) = signal(SIGINT, s_czmq_handler);
+
+	assert(s_start_killed(zloop_new())==0);
+	assert(s_chained==1);
+
+	zloop_t *zloop = zloop_new();
+	zloop_ignore_interrupts(zloop);
+	zloop_timer(zloop, 10, 1, s_raise, NULL);
+	zloop_timer(zloop, 50, 1, s_stop, NULL);
+	assert(zloop_start(zloop)==-1);
+	assert(s_chained==2);
+	zloop_destroy(&zloop);
+	zsys_interrupted = zctx_interrupted = 0;
+
+	// the flags set by the application itself
+	zloop = zloop_new();
+	zloop_timer(zloop, 10, 1, s_interrupt, NULL);
+	zloop_timer(zloop, 1000, 1, s_stop, NULL);
+	assert(zloop_start(zloop)==0);
+	zloop_destroy(&zloop);
+	zsys_interrupted = zctx_interrupted = 0;
+
+	// a handler that leaves the flags alone keeps the loop running
+	signal(SIGINT, s_app_handler);
+	assert(s_start_killed(zloop_new())==-1);
+	assert(s_chained==3);
+
+	// opted out, CZMQ's handler is left alone and the loop only sees the
+	// flags on its next wakeup
+	signal(SIGINT, s_czmq_handler);
+	zloop_set_signal_wakeup(false);
+	assert(s_start_killed(zloop_new())==-1);
+	assert(s_chained==4);
+	zloop = zloop_new();
+	zloop_timer(zloop, 10, 1, s_raise, NULL);
+	zloop_timer(zloop, 1000, 1, s_stop, NULL);
+	assert(zloop_start(zloop)==0);
+	struct sigaction current;
+	sigaction(SIGINT, NULL, &current);
+	assert(current.sa_handler==s_czmq_handler);
+	assert(s_chained==5);
+	zloop_destroy(&zloop);
+	zsys_interrupted = zctx_interrupted = 0;
+	zloop_set_signal_wakeup(true);
+
+	signal(SIGINT, previous);
+}
+
+// tasks posted from several threads all run on the loop's thread
+
+#define POST_THREADS 4
+#define POST_TASKS 10000
+
+static int s_posted;
+static pthread_t s_loop_thread;
+
+static int
+s_post_task(zloop_t *zloop, void *arg)
+{
+	assert(pthread_equal(pthread_self(), s_loop_thread));
+	return ++s_posted==POST_THREADS * POST_TASKS ? -1 : 0;
+}
+
+static void *
+s_post_thread(void *arg)
+{
+	int idx;
+	for (idx=0; idx < POST_TASKS; idx++) {
+		int rc = zloop_post((zloop_t *)arg, s_post_task, NULL);
+		assert(rc==0);
+	}
+	return NULL;
+}
+
+static void
+s_check_post(void)
+{
+	zloop_t *zloop = zloop_new();
+	zloop_timer(zloop, 10000, 1, s_stop, NULL);
+	s_loop_thread = pthread_self();
+
+	pthread_t threads[POST_THREADS];
+	int idx;
+	for (idx=0; idx < POST_THREADS; idx++)
+		pthread_create(&threads[idx], NULL, s_post_thread, zloop);
+	assert(zloop_start(zloop)==-1);
+	for (idx=0; idx < POST_THREADS; idx++)
+		pthread_join(threads[idx], NULL);
+	assert(s_posted==POST_THREADS * POST_TASKS);
+
+	// dropped with the loop
+	zloop_post(zloop, s_post_task, NULL);
+	zloop_destroy(&zloop);
+}
+
+// a tolerant fd poller reports a bad fd once, then resumes once it is
+// valid again
+
+static int s_fd_errors;
+static int s_fd_reads;
+
+static int
+s_fd_event(zloop_t *zloop, zmq_pollitem_t *item, void *arg)
+{
+	if (item->revents & ZMQ_POLLERR) {
+		s_fd_errors++;
+	} else if (item->revents & ZMQ_POLLIN) {
+		char buf;
+		assert(read(item->fd, &buf, 1)==1);
+		s_fd_reads++;
+	}
+	return 0;
+}
+
+static int
+s_nothing(zloop_t *zloop, int timer_id, void *arg)
+{
+	return 0;
+}
+
+static int
+s_revive(zloop_t *zloop, int timer_id, void *arg)
+{
+	int *pipefd = (int *)arg;
+	dup2(pipefd[0], pipefd[2]);
+	assert(write(pipefd[1], "x", 1)==1);
+	return 0;
+}
+
+static void
+s_check_tolerant(void)
+{
+	// pipefd[2] is not open until revived
+	int pipefd[3];
+	assert(pipe(pipefd)==0);
+	pipefd[2] = 200;
+
+	zloop_t *zloop = zloop_new();
+	zmq_pollitem_t item = { NULL, pipefd[2], ZMQ_POLLIN, 0 };
+	zloop_poller(zloop, &item, s_fd_event, NULL);
+	zloop_poller_set_tolerant(zloop, &item);
+
+	// libev reports the bad fd on the next wakeup
+	zloop_timer(zloop, 10, 1, s_nothing, NULL);
+	zloop_timer(zloop, 300, 1, s_revive, pipefd);
+	zloop_timer(zloop, 1000, 1, s_stop, NULL);
+	zloop_start(zloop);
+	assert(s_fd_errors==1 && s_fd_reads==1);
+	assert(zloop_poller_errors(zloop, &item) > 1);
+
+	zloop_destroy(&zloop);
+	close(pipefd[0]);
+	close(pipefd[1]);
+	close(pipefd[2]);
+}
+
+#endif
+
+// whole messages only, frame i of a message being i bytes
+
+static int
+s_multipart_event(zloop_t *zloop, zsock_t *reader,
+		const zloop_frame_t *frames, size_t nframes, void *arg)
+{
+	int *count = (int *)arg;
+	assert(nframes==(size_t)(*count % 5 + 1));
+
+	size_t idx;
+	for (idx=0; idx < nframes; idx++)
+		assert(frames[idx].size==idx);
+	return ++*count==50 ? -1 : 0;
+}
+
+static void
+s_check_multipart_reader(void)
+{
+	void *zctx = zmq_ctx_new();
+	void *pull = zmq_socket(zctx, ZMQ_PULL);
+	void *push = zmq_socket(zctx, ZMQ_PUSH);
+	zmq_bind(pull, "inproc://check-multipart");
+	zmq_connect(push, "inproc://check-multipart");
+
+	int msg;
+	for (msg=0; msg < 50; msg++) {
+		int nframes = msg % 5 + 1;
+		int idx;
+		for (idx=0; idx < nframes; idx++)
+			zmq_send(push, "xxxx", idx, idx < nframes - 1 ? ZMQ_SNDMORE : 0);
+	}
+
+	zloop_t *zloop = zloop_new();
+	int count = 0;
+	zloop_multipart_reader(zloop, (zsock_t *)pull, s_multipart_event, &count);
+	zloop_timer(zloop, 1000, 1, s_stop, NULL);
+	assert(zloop_start(zloop)==-1);
+	assert(count==50);
+	zloop_destroy(&zloop);
+
+	zmq_close(pull);
+	zmq_close(push);
+	zmq_ctx_destroy(zctx);
+}
+
+static void
+s_checks(void)
 {
+	s_check_timer();
+	s_check_ticket();
+	s_check_multipart_reader();
+	#ifndef _WIN32
+	s_check_signal();
+	s_check_post();
+	s_check_tolerant();
+	#endif
+	printf("checks passed\n");
+}
+
+// with -c, only runs the self checks
+int main(int argc, char **argv)
+{
+	s_checks();
+	if (argc > 1 && !strcmp(argv[1], "-c"))
+		return 0;
+
 	zloop_compat_test();
 	return 0;
 }
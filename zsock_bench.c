@@ -0,0 +1,579 @@
+
+// watcher overhead benchmarks: ev_zsock vs uv_zsock vs a plain zmq_poll loop.
+// results are written to stdout as one JSON object per line. cases that
+// would not fit in the fd limit get a record with "skipped" instead.
+//
+// usage: zsock_bench [-q] [-t inproc|ipc|tcp]
+//	-q	quick run, fewer sockets and shorter runs
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include <ev.h>
+#include <uv.h>
+#include <zmq.h>
+
+#include "ev_zsock.h"
+#include "uv_zsock.h"
+#include "latency_hist.h"
+
+typedef enum { IMPL_EV, IMPL_EV_LAZY, IMPL_EV_DRAIN, IMPL_EV_BUSY, IMPL_UV, IMPL_ZMQ_POLL } impl_t;
+
+static const char *s_impl_names[] = {
+	"ev_zsock", "ev_zsock_lazy", "ev_zsock_drain", "ev_zsock_busy", "uv_zsock", "zmq_poll"
+};
+
+static void *s_zctx;
+static const char *s_transport;
+static int s_endpoint_seq;
+static double s_duration = 1.0;
+static rlim_t s_max_fds = RLIM_INFINITY;
+
+// binds `bind` to a fresh endpoint of the selected transport and
+// connects `connect` to it
+static void
+s_link(void *bind, void *connect)
+{
+	char endpoint[256];
+	if (strcmp(s_transport, "inproc")==0)
+		sprintf(endpoint, "inproc://zsock_bench-%d", s_endpoint_seq++);
+	else if (strcmp(s_transport, "ipc")==0)
+		sprintf(endpoint, "ipc:///tmp/zsock_bench-%d-%d", (int)getpid(), s_endpoint_seq++);
+	else
+		strcpy(endpoint, "tcp://127.0.0.1:*");
+
+	int rc = zmq_bind(bind, endpoint);
+	assert(rc!=-1);
+
+	size_t len = sizeof(endpoint);
+	rc = zmq_getsockopt(bind, ZMQ_LAST_ENDPOINT, endpoint, &len);
+	assert(rc!=-1);
+	rc = zmq_connect(connect, endpoint);
+	assert(rc!=-1);
+}
+
+static void
+s_close_all(void **socks, int count)
+{
+	int linger = 0;
+	int idx;
+	for (idx=0; idx < count; idx++) {
+		if (!socks[idx])
+			continue;
+		zmq_setsockopt(socks[idx], ZMQ_LINGER, &linger, sizeof(linger));
+		zmq_close(socks[idx]);
+	}
+}
+
+static void
+s_drain_socket(void *zsock, long *count)
+{
+	char buf[64];
+	while (zmq_recv(zsock, buf, sizeof(buf), ZMQ_DONTWAIT) != -1)
+		(*count)++;
+}
+
+//
+// 1. per-iteration overhead: nsocks registered, nactive of them receive
+// one message per loop iteration. an idle watcher keeps the loop spinning.
+//
+
+typedef struct {
+	int nsocks;
+	int nactive;
+	void **recv;		// nsocks, all registered
+	void **send;		// nactive, peers of the first nactive
+	long iterations;
+	long received;
+	uint64_t t_end;
+} overhead_t;
+
+static overhead_t s_ovh;
+
+static int
+s_overhead_iteration(void)
+{
+	int idx;
+	for (idx=0; idx < s_ovh.nactive; idx++)
+		zmq_send(s_ovh.send[idx], "x", 1, ZMQ_DONTWAIT);
+
+	s_ovh.iterations++;
+	return (s_ovh.iterations & 255) || latency_hist_now() < s_ovh.t_end;
+}
+
+static void
+s_ev_overhead_zsock_cb(struct ev_loop *loop, ev_zsock_t *wz, int revents)
+{
+	s_drain_socket(wz->zsock, &s_ovh.received);
+}
+
+static void
+s_ev_overhead_idle_cb(struct ev_loop *loop, ev_idle *w, int revents)
+{
+	if (!s_overhead_iteration())
+		ev_break(loop, EVBREAK_ALL);
+}
+
+static void
+s_uv_overhead_zsock_cb(uv_zsock_t *wz, int revents)
+{
+	s_drain_socket(wz->zsock, &s_ovh.received);
+}
+
+static void
+s_uv_overhead_idle_cb(uv_idle_t *handle)
+{
+	if (!s_overhead_iteration())
+		uv_stop(handle->loop);
+}
+
+// a non-zero share is at least one socket
+static int
+s_active_count(int nsocks, int active_pct)
+{
+	int nactive = nsocks * active_pct / 100;
+	if (active_pct > 0 && nactive==0)
+		nactive = 1;
+	return nactive;
+}
+
+static void
+s_bench_overhead(impl_t impl, int nsocks, int active_pct)
+{
+	memset(&s_ovh, 0, sizeof(s_ovh));
+	s_ovh.nsocks = nsocks;
+	s_ovh.nactive = s_active_count(nsocks, active_pct);
+	s_ovh.recv = (void **)calloc(nsocks, sizeof(void *));
+	s_ovh.send = (void **)calloc(nsocks, sizeof(void *));
+
+	// only the active sockets need a peer, the others are
+	// registered but never see any traffic
+	int idx;
+	for (idx=0; idx < nsocks; idx++) {
+		s_ovh.recv[idx] = zmq_socket(s_zctx, ZMQ_PULL);
+		assert(s_ovh.recv[idx]);
+		if (idx < s_ovh.nactive) {
+			s_ovh.send[idx] = zmq_socket(s_zctx, ZMQ_PUSH);
+			s_link(s_ovh.recv[idx], s_ovh.send[idx]);
+		}
+	}
+
+	uint64_t t_start;
+
+	if (impl==IMPL_EV || impl==IMPL_EV_LAZY) {
+		struct ev_loop *loop = ev_loop_new(0);
+		ev_zsock_t *wzs = (ev_zsock_t *)calloc(nsocks, sizeof(ev_zsock_t));
+		for (idx=0; idx < nsocks; idx++) {
+			ev_zsock_init(&wzs[idx], s_ev_overhead_zsock_cb, s_ovh.recv[idx], EV_READ);
+			ev_zsock_set_lazy(&wzs[idx], impl==IMPL_EV_LAZY);
+			ev_zsock_start(loop, &wzs[idx]);
+		}
+
+		ev_idle w_idle;
+		ev_idle *pw_idle = &w_idle;
+		ev_idle_init(pw_idle, s_ev_overhead_idle_cb);
+		ev_idle_start(loop, &w_idle);
+
+		t_start = latency_hist_now();
+		s_ovh.t_end = t_start + (uint64_t)(s_duration * 1e9);
+		ev_run(loop, 0);
+
+		ev_zsock_registry_destroy(loop);
+		ev_loop_destroy(loop);
+		free(wzs);
+	} else if (impl==IMPL_UV) {
+		uv_loop_t uvloop;
+		uv_loop_init(&uvloop);
+		uv_zsock_t *wzs = (uv_zsock_t *)calloc(nsocks, sizeof(uv_zsock_t));
+		for (idx=0; idx < nsocks; idx++) {
+			uv_zsock_init(&uvloop, &wzs[idx], s_ovh.recv[idx]);
+			uv_zsock_start(&wzs[idx], s_uv_overhead_zsock_cb, UV_READABLE);
+		}
+
+		uv_idle_t w_idle;
+		uv_idle_init(&uvloop, &w_idle);
+		uv_idle_start(&w_idle, s_uv_overhead_idle_cb);
+
+		t_start = latency_hist_now();
+		s_ovh.t_end = t_start + (uint64_t)(s_duration * 1e9);
+		uv_run(&uvloop, 0);
+
+		uv_close((uv_handle_t*)&w_idle, NULL);
+		for (idx=0; idx < nsocks; idx++)
+			uv_zsock_close(&wzs[idx], NULL);
+		uv_run(&uvloop, 0);
+		int rc = uv_loop_close(&uvloop);
+		assert(rc==0);
+		free(wzs);
+	} else {
+		zmq_pollitem_t *items = (zmq_pollitem_t *)calloc(nsocks, sizeof(zmq_pollitem_t));
+		for (idx=0; idx < nsocks; idx++) {
+			items[idx].socket = s_ovh.recv[idx];
+			items[idx].events = ZMQ_POLLIN;
+		}
+
+		t_start = latency_hist_now();
+		s_ovh.t_end = t_start + (uint64_t)(s_duration * 1e9);
+		while (s_overhead_iteration()) {
+			zmq_poll(items, nsocks, 0);
+			for (idx=0; idx < nsocks; idx++) {
+				if (items[idx].revents & ZMQ_POLLIN)
+					s_drain_socket(items[idx].socket, &s_ovh.received);
+			}
+		}
+		free(items);
+	}
+
+	double elapsed = (latency_hist_now() - t_start) * 1e-9;
+	printf("{\"bench\": \"overhead\", \"impl\": \"%s\", \"transport\": \"%s\", "
+		"\"sockets\": %d, \"active\": %d, \"iterations\": %ld, "
+		"\"received\": %ld, \"ns_per_iteration\": %.1f}\n",
+		s_impl_names[impl], s_transport, nsocks, s_ovh.nactive,
+		s_ovh.iterations, s_ovh.received, elapsed * 1e9 / s_ovh.iterations);
+	fflush(stdout);
+
+	s_close_all(s_ovh.recv, nsocks);
+	s_close_all(s_ovh.send, nsocks);
+	free(s_ovh.recv);
+	free(s_ovh.send);
+}
+
+// roughly: a mailbox per socket, and on ipc/tcp a listener and both
+// ends of a connection per active pair, plus the context's and loop's own
+static long
+s_overhead_fds(int nsocks, int nactive)
+{
+	int per_pair = strcmp(s_transport, "inproc")==0 ? 1 : 4;
+	return nsocks + (long)nactive * per_pair + 64;
+}
+
+// a case that is not run still gets its record, so that it is not
+// mistaken for a missing result
+static void
+s_skip_overhead(impl_t impl, int nsocks, int nactive, long fds)
+{
+	printf("{\"bench\": \"overhead\", \"impl\": \"%s\", \"transport\": \"%s\", "
+		"\"sockets\": %d, \"active\": %d, \"skipped\": \"fd limit\", "
+		"\"fds_needed\": %ld, \"fd_limit\": %ld}\n",
+		s_impl_names[impl], s_transport, nsocks, nactive, fds, (long)s_max_fds);
+	fflush(stdout);
+}
+
+//
+// 2. throughput of a single hot socket fed by another thread
+//
+
+typedef struct {
+	void *send;
+	long total;
+	long received;
+	uint64_t t_first;
+	uint64_t t_last;
+} throughput_t;
+
+static throughput_t s_tput;
+
+static void *
+s_sender_thread(void *arg)
+{
+	long idx;
+	for (idx=0; idx < s_tput.total; idx++)
+		zmq_send(s_tput.send, "12345678", 8, 0);
+	return NULL;
+}
+
+static int
+s_throughput_count(long count)
+{
+	if (s_tput.received==0 && count > 0)
+		s_tput.t_first = latency_hist_now();
+	s_tput.received += count;
+	if (s_tput.received < s_tput.total)
+		return 1;
+	s_tput.t_last = latency_hist_now();
+	return 0;
+}
+
+static void
+s_ev_tput_cb(struct ev_loop *loop, ev_zsock_t *wz, int revents)
+{
+	long count = 0;
+	s_drain_socket(wz->zsock, &count);
+	if (!s_throughput_count(count))
+		ev_break(loop, EVBREAK_ALL);
+}
+
+static void
+s_ev_tput_drain_cb(struct ev_loop *loop, ev_zsock_t *wz, zmq_msg_t *msgs, int count)
+{
+	if (!s_throughput_count(count))
+		ev_break(loop, EVBREAK_ALL);
+}
+
+static void
+s_uv_tput_cb(uv_zsock_t *wz, zmq_msg_t *msgs, int count)
+{
+	if (!s_throughput_count(count))
+		uv_stop(wz->loop);
+}
+
+static void
+s_bench_throughput(impl_t impl, long total)
+{
+	memset(&s_tput, 0, sizeof(s_tput));
+	s_tput.total = total;
+
+	void *recv = zmq_socket(s_zctx, ZMQ_PULL);
+	s_tput.send = zmq_socket(s_zctx, ZMQ_PUSH);
+	s_link(recv, s_tput.send);
+
+	pthread_t thread;
+	pthread_create(&thread, NULL, s_sender_thread, NULL);
+
+	if (impl==IMPL_EV || impl==IMPL_EV_DRAIN) {
+		struct ev_loop *loop = ev_loop_new(0);
+		ev_zsock_t wz;
+		ev_zsock_init(&wz, s_ev_tput_cb, recv, EV_READ);
+		if (impl==IMPL_EV_DRAIN)
+			ev_zsock_set_drain(&wz, s_ev_tput_drain_cb, 256, 0);
+		ev_zsock_start(loop, &wz);
+		ev_run(loop, 0);
+		ev_zsock_registry_destroy(loop);
+		ev_loop_destroy(loop);
+	} else if (impl==IMPL_UV) {
+		uv_loop_t uvloop;
+		uv_loop_init(&uvloop);
+		uv_zsock_t wz;
+		uv_zsock_init(&uvloop, &wz, recv);
+		uv_zsock_recv_start(&wz, s_uv_tput_cb, 256);
+		uv_run(&uvloop, 0);
+		uv_zsock_close(&wz, NULL);
+		uv_run(&uvloop, 0);
+		uv_loop_close(&uvloop);
+	} else {
+		zmq_pollitem_t item = { recv, 0, ZMQ_POLLIN, 0 };
+		int more = 1;
+		while (more) {
+			zmq_poll(&item, 1, -1);
+			long count = 0;
+			s_drain_socket(recv, &count);
+			more = s_throughput_count(count);
+		}
+	}
+
+	pthread_join(thread, NULL);
+
+	double elapsed = (s_tput.t_last - s_tput.t_first) * 1e-9;
+	printf("{\"bench\": \"throughput\", \"impl\": \"%s\", \"transport\": \"%s\", "
+		"\"messages\": %ld, \"seconds\": %.6f, \"msgs_per_sec\": %.0f}\n",
+		s_impl_names[impl], s_transport, s_tput.received, elapsed,
+		s_tput.received / elapsed);
+	fflush(stdout);
+
+	void *socks[] = { recv, s_tput.send };
+	s_close_all(socks, 2);
+}
+
+//
+// 3. ping-pong round trip through an echo thread
+//
+
+typedef struct {
+	void *echo;
+	long total;
+	long done;
+	uint64_t t_sent;
+	latency_hist_t hist;
+} pingpong_t;
+
+static pingpong_t s_ping;
+
+static void *
+s_echo_thread(void *arg)
+{
+	char buf[64];
+	while (1) {
+		int nbytes = zmq_recv(s_ping.echo, buf, sizeof(buf), 0);
+		if (nbytes <= 0)
+			break;	// empty message means quit
+		zmq_send(s_ping.echo, buf, nbytes, 0);
+	}
+	return NULL;
+}
+
+// returns 0 once all the round trips are done
+static int
+s_pingpong_step(void *zsock)
+{
+	char buf[64];
+	if (zmq_recv(zsock, buf, sizeof(buf), ZMQ_DONTWAIT)==-1)
+		return 1;
+
+	latency_hist_record(&s_ping.hist, latency_hist_now() - s_ping.t_sent);
+	if (++s_ping.done==s_ping.total)
+		return 0;
+
+	s_ping.t_sent = latency_hist_now();
+	zmq_send(zsock, "ping", 4, 0);
+	return 1;
+}
+
+static void
+s_ev_ping_cb(struct ev_loop *loop, ev_zsock_t *wz, int revents)
+{
+	if (!s_pingpong_step(wz->zsock))
+		ev_break(loop, EVBREAK_ALL);
+}
+
+static void
+s_uv_ping_cb(uv_zsock_t *wz, int revents)
+{
+	if (!s_pingpong_step(wz->zsock))
+		uv_stop(wz->loop);
+}
+
+static void
+s_bench_pingpong(impl_t impl, long total)
+{
+	memset(&s_ping, 0, sizeof(s_ping));
+	s_ping.total = total;
+	latency_hist_reset(&s_ping.hist);
+
+	void *ping = zmq_socket(s_zctx, ZMQ_PAIR);
+	s_ping.echo = zmq_socket(s_zctx, ZMQ_PAIR);
+	s_link(s_ping.echo, ping);
+
+	pthread_t thread;
+	pthread_create(&thread, NULL, s_echo_thread, NULL);
+
+	s_ping.t_sent = latency_hist_now();
+	zmq_send(ping, "ping", 4, 0);
+
+	if (impl==IMPL_EV || impl==IMPL_EV_BUSY) {
+		struct ev_loop *loop = ev_loop_new(0);
+		ev_zsock_t wz;
+		ev_zsock_init(&wz, s_ev_ping_cb, ping, EV_READ);
+		if (impl==IMPL_EV_BUSY)
+			ev_zsock_set_busy_poll(&wz, 100e-6);
+		ev_zsock_start(loop, &wz);
+		ev_run(loop, 0);
+		ev_zsock_registry_destroy(loop);
+		ev_loop_destroy(loop);
+	} else if (impl==IMPL_UV) {
+		uv_loop_t uvloop;
+		uv_loop_init(&uvloop);
+		uv_zsock_t wz;
+		uv_zsock_init(&uvloop, &wz, ping);
+		uv_zsock_start(&wz, s_uv_ping_cb, UV_READABLE);
+		uv_run(&uvloop, 0);
+		uv_zsock_close(&wz, NULL);
+		uv_run(&uvloop, 0);
+		uv_loop_close(&uvloop);
+	} else {
+		zmq_pollitem_t item = { ping, 0, ZMQ_POLLIN, 0 };
+		do {
+			zmq_poll(&item, 1, -1);
+		} while (s_pingpong_step(ping));
+	}
+
+	zmq_send(ping, "", 0, 0);
+	pthread_join(thread, NULL);
+
+	latency_hist_t *hist = &s_ping.hist;
+	printf("{\"bench\": \"pingpong\", \"impl\": \"%s\", \"transport\": \"%s\", "
+		"\"round_trips\": %ld, \"mean_ns\": %.0f, \"p50_ns\": %llu, "
+		"\"p90_ns\": %llu, \"p99_ns\": %llu, \"p999_ns\": %llu, \"max_ns\": %llu}\n",
+		s_impl_names[impl], s_transport, s_ping.done,
+		(double)hist->sum / hist->count,
+		(unsigned long long)latency_hist_percentile(hist, 50),
+		(unsigned long long)latency_hist_percentile(hist, 90),
+		(unsigned long long)latency_hist_percentile(hist, 99),
+		(unsigned long long)latency_hist_percentile(hist, 99.9),
+		(unsigned long long)hist->max);
+	fflush(stdout);
+
+	void *socks[] = { ping, s_ping.echo };
+	s_close_all(socks, 2);
+}
+
+static void
+s_run_transport(const char *transport, int quick)
+{
+	static const int scales[] = { 1, 10, 100, 1000, 10000 };
+	static const int active_pcts[] = { 0, 1, 100 };
+	static const impl_t overhead_impls[] = { IMPL_EV, IMPL_EV_LAZY, IMPL_UV, IMPL_ZMQ_POLL };
+	static const impl_t tput_impls[] = { IMPL_EV, IMPL_EV_DRAIN, IMPL_UV, IMPL_ZMQ_POLL };
+	static const impl_t pingpong_impls[] = { IMPL_EV, IMPL_EV_BUSY, IMPL_UV, IMPL_ZMQ_POLL };
+
+	s_transport = transport;
+	int nscales = quick ? 4 : 5;
+
+	int scale, pct, impl;
+	for (scale=0; scale < nscales; scale++) {
+		for (pct=0; pct < 3; pct++) {
+			// every socket active at 10k may not fit in the fd limit
+			int nactive = s_active_count(scales[scale], active_pcts[pct]);
+			long fds = s_overhead_fds(scales[scale], nactive);
+			if (s_max_fds!=RLIM_INFINITY && fds > (long)s_max_fds) {
+				for (impl=0; impl < 4; impl++)
+					s_skip_overhead(overhead_impls[impl], scales[scale], nactive, fds);
+				continue;
+			}
+			for (impl=0; impl < 4; impl++)
+				s_bench_overhead(overhead_impls[impl], scales[scale], active_pcts[pct]);
+		}
+	}
+
+	for (impl=0; impl < 4; impl++)
+		s_bench_throughput(tput_impls[impl], quick ? 200000 : 2000000);
+
+	for (impl=0; impl < 4; impl++)
+		s_bench_pingpong(pingpong_impls[impl], quick ? 10000 : 100000);
+}
+
+int main(int argc, char *argv[])
+{
+	int quick = 0;
+	const char *only = NULL;
+
+	int idx;
+	for (idx=1; idx < argc; idx++) {
+		if (strcmp(argv[idx], "-q")==0)
+			quick = 1;
+		else if (strcmp(argv[idx], "-t")==0 && idx + 1 < argc)
+			only = argv[++idx];
+		else {
+			fprintf(stderr, "usage: %s [-q] [-t inproc|ipc|tcp]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (quick)
+		s_duration = 0.2;
+
+	// every zmq socket holds a file descriptor
+	struct rlimit rl;
+	if (getrlimit(RLIMIT_NOFILE, &rl)==0) {
+		rl.rlim_cur = rl.rlim_max;
+		if (setrlimit(RLIMIT_NOFILE, &rl)==0 || getrlimit(RLIMIT_NOFILE, &rl)==0)
+			s_max_fds = rl.rlim_cur;
+	}
+
+	s_zctx = zmq_ctx_new();
+	zmq_ctx_set(s_zctx, ZMQ_MAX_SOCKETS, 32768);
+
+	static const char *transports[] = { "inproc", "ipc", "tcp" };
+	for (idx=0; idx < 3; idx++) {
+		if (!only || strcmp(only, transports[idx])==0)
+			s_run_transport(transports[idx], quick);
+	}
+
+	zmq_ctx_destroy(s_zctx);
+	return 0;
+}
+